@@ -2,7 +2,80 @@
 #define AreaLight_H
 
 #include "hittable.h"
+#include "material.h"
 
+/*
+*从o点看矩形所张的球面矩形，按立体角均匀采样（Urena等人2013年的方法）。
+*s是矩形的一个角，ex、ey是两条互相垂直的边
+*/
+struct spherical_rect {
+    vec3 o, x, y, z;
+    double x0, y0, z0, x1, y1;
+    double b0, b1, k;
+    double solid_angle = 0;
+
+    spherical_rect(const vec3& s, const vec3& ex, const vec3& ey, const vec3& origin) : o(origin) {
+        double exl = ex.length(), eyl = ey.length();
+        x = ex / exl;
+        y = ey / eyl;
+        z = cross(x, y);
+        vec3 d = s - o;
+        z0 = dot(d, z);
+        //让矩形位于局部坐标系z<0的一侧
+        if (z0 > 0) {
+            z = -z;
+            z0 = -z0;
+        }
+        x0 = dot(d, x);
+        y0 = dot(d, y);
+        x1 = x0 + exl;
+        y1 = y0 + eyl;
+        if (z0 == 0)
+            return;
+
+        //四个顶点和o构成的四个平面的法线，球面矩形的内角由相邻法线求出
+        vec3 v00(x0, y0, z0), v01(x0, y1, z0), v10(x1, y0, z0), v11(x1, y1, z0);
+        vec3 n0 = unit_vector(cross(v00, v10));
+        vec3 n1 = unit_vector(cross(v10, v11));
+        vec3 n2 = unit_vector(cross(v11, v01));
+        vec3 n3 = unit_vector(cross(v01, v00));
+        double g0 = acos(clamp(-dot(n0, n1), -1.0, 1.0));
+        double g1 = acos(clamp(-dot(n1, n2), -1.0, 1.0));
+        double g2 = acos(clamp(-dot(n2, n3), -1.0, 1.0));
+        double g3 = acos(clamp(-dot(n3, n0), -1.0, 1.0));
+        b0 = n0.z();
+        b1 = n2.z();
+        k = 2 * pi - g2 - g3;
+        solid_angle = g0 + g1 - k;
+    }
+
+    //立体角太小时浮点误差大，太大（o几乎贴在矩形上）时反而不如按面积采样
+    bool usable(const material* m) const {
+        return solid_angle > 3e-4 && solid_angle < 6.22 && !(m && m->emission_distribution());
+    }
+
+    //返回矩形上的点
+    vec3 sample(double u, double v) const {
+        //先按立体角比例确定x，再在该x对应的弧上确定y
+        double au = u * solid_angle + k;
+        double fu = (cos(au) * b0 - b1) / sin(au);
+        double cu = clamp((fu > 0 ? 1 : -1) / sqrt(fu * fu + b0 * b0), -1.0, 1.0);
+        double xu = clamp(-(cu * z0) / sqrt(ffmax(1 - cu * cu, 1e-20)), x0, x1);
+        double d = sqrt(xu * xu + z0 * z0);
+        double h0 = y0 / sqrt(d * d + y0 * y0);
+        double h1 = y1 / sqrt(d * d + y1 * y1);
+        double hv = h0 + v * (h1 - h0), hv2 = hv * hv;
+        double yv = hv2 < 1 - 1e-12 ? (hv * d) / sqrt(1 - hv2) : y1;
+        return o + xu * x + yv * y + z0 * z;
+    }
+};
+
+//在矩形上按面积采样时对应的立体角pdf，发光贴图有uv分布时按uv上的密度加权
+inline double rect_pdf(const vec3& v, const hit_record& rec, double area) {
+    auto distance_squared = rec.t * rec.t * v.length_squared();
+    auto cosine = fabs(dot(v, rec.normal) / v.length());
+    return distance_squared * emission_uv_pdf(rec.mat_ptr, rec.u, rec.v) / (cosine * area);
+}
 
 class xy_rect : public hittable {
 public:
@@ -12,6 +85,12 @@ public:
         : x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k), mp(mat) {}
 
     virtual bool hit(const ray& r, double t0, double t1, hit_record& rec) const;
+    virtual bool occluded(const ray& r, double t0, double t1) const;
+    virtual bool light_info(light_bounds& lb) const;
+    virtual double pdf_value(const vec3& o, const vec3& v) const;
+    virtual vec3 random(const vec3& o) const;
+    virtual bool sample_point(hit_record& rec, double& pdf) const;
+    virtual double pdf_point(const vec3& p) const;
 
     virtual bool bounding_box(double t0, double t1, aabb& output_box) const {
         output_box = aabb(vec3(x0, y0, k - 0.0001), vec3(x1, y1, k + 0.0001));
@@ -24,7 +103,7 @@ public:
 };
 
 bool xy_rect::hit(const ray& r, double t0, double t1, hit_record& rec) const {
-    //ߵԴҪʱ
+    //算出光线到面光源所需要的时间
     auto t = (k - r.origin().z()) / r.direction().z();
     if (t < t0 || t > t1)
         return false;
@@ -37,7 +116,10 @@ bool xy_rect::hit(const ray& r, double t0, double t1, hit_record& rec) const {
     rec.t = t;
     vec3 outward_normal = vec3(0, 0, 1);
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mp;
+    rec.dpdu = vec3(x1 - x0, 0, 0);
+    rec.dpdv = vec3(0, y1 - y0, 0);
+    rec.mat_ptr = mp.get();
+    rec.object = this;
     rec.p = r.at(t);
     return true;
 }
@@ -50,6 +132,12 @@ public:
         : x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_k), mp(mat) {}
 
     virtual bool hit(const ray& r, double t0, double t1, hit_record& rec) const;
+    virtual bool occluded(const ray& r, double t0, double t1) const;
+    virtual bool light_info(light_bounds& lb) const;
+    virtual double pdf_value(const vec3& o, const vec3& v) const;
+    virtual vec3 random(const vec3& o) const;
+    virtual bool sample_point(hit_record& rec, double& pdf) const;
+    virtual double pdf_point(const vec3& p) const;
 
     virtual bool bounding_box(double t0, double t1, aabb& output_box) const {
         output_box = aabb(vec3(x0, k - 0.0001, z0), vec3(x1, k + 0.0001, z1));
@@ -69,6 +157,12 @@ public:
         : y0(_y0), y1(_y1), z0(_z0), z1(_z1), k(_k), mp(mat) {}
 
     virtual bool hit(const ray& r, double t0, double t1, hit_record& rec) const;
+    virtual bool occluded(const ray& r, double t0, double t1) const;
+    virtual bool light_info(light_bounds& lb) const;
+    virtual double pdf_value(const vec3& o, const vec3& v) const;
+    virtual vec3 random(const vec3& o) const;
+    virtual bool sample_point(hit_record& rec, double& pdf) const;
+    virtual double pdf_point(const vec3& p) const;
 
     virtual bool bounding_box(double t0, double t1, aabb& output_box) const {
         output_box = aabb(vec3(k - 0.0001, y0, z0), vec3(k + 0.0001, y1, z1));
@@ -93,7 +187,10 @@ bool xz_rect::hit(const ray& r, double t0, double t1, hit_record& rec) const {
     rec.t = t;
     vec3 outward_normal = vec3(0, 1, 0);
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mp;
+    rec.dpdu = vec3(x1 - x0, 0, 0);
+    rec.dpdv = vec3(0, 0, z1 - z0);
+    rec.mat_ptr = mp.get();
+    rec.object = this;
     rec.p = r.at(t);
     return true;
 }
@@ -111,11 +208,174 @@ bool yz_rect::hit(const ray& r, double t0, double t1, hit_record& rec) const {
     rec.t = t;
     vec3 outward_normal = vec3(1, 0, 0);
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mp;
+    rec.dpdu = vec3(0, y1 - y0, 0);
+    rec.dpdv = vec3(0, 0, z1 - z0);
+    rec.mat_ptr = mp.get();
+    rec.object = this;
     rec.p = r.at(t);
     return true;
 }
 
+bool xy_rect::occluded(const ray& r, double t0, double t1) const {
+    auto t = (k - r.origin().z()) / r.direction().z();
+    if (t < t0 || t > t1)
+        return false;
+    auto x = r.origin().x() + t * r.direction().x();
+    auto y = r.origin().y() + t * r.direction().y();
+    return x >= x0 && x <= x1 && y >= y0 && y <= y1;
+}
+
+bool xz_rect::occluded(const ray& r, double t0, double t1) const {
+    auto t = (k - r.origin().y()) / r.direction().y();
+    if (t < t0 || t > t1)
+        return false;
+    auto x = r.origin().x() + t * r.direction().x();
+    auto z = r.origin().z() + t * r.direction().z();
+    return x >= x0 && x <= x1 && z >= z0 && z <= z1;
+}
+
+bool yz_rect::occluded(const ray& r, double t0, double t1) const {
+    auto t = (k - r.origin().x()) / r.direction().x();
+    if (t < t0 || t > t1)
+        return false;
+    auto y = r.origin().y() + t * r.direction().y();
+    auto z = r.origin().z() + t * r.direction().z();
+    return y >= y0 && y <= y1 && z >= z0 && z <= z1;
+}
+
+
+//面光源只向法线一侧发光
+bool xy_rect::light_info(light_bounds& lb) const {
+    bounding_box(0, 1, lb.bounds);
+    lb.w = vec3(0, 0, 1);
+    lb.phi = (x1 - x0) * (y1 - y0);
+    lb.cos_theta_o = 1;
+    lb.cos_theta_e = 0;
+    lb.mat = mp.get();
+    return true;
+}
+
+bool xz_rect::light_info(light_bounds& lb) const {
+    bounding_box(0, 1, lb.bounds);
+    lb.w = vec3(0, 1, 0);
+    lb.phi = (x1 - x0) * (z1 - z0);
+    lb.cos_theta_o = 1;
+    lb.cos_theta_e = 0;
+    lb.mat = mp.get();
+    return true;
+}
+
+bool yz_rect::light_info(light_bounds& lb) const {
+    bounding_box(0, 1, lb.bounds);
+    lb.w = vec3(1, 0, 0);
+    lb.phi = (y1 - y0) * (z1 - z0);
+    lb.cos_theta_o = 1;
+    lb.cos_theta_e = 0;
+    lb.mat = mp.get();
+    return true;
+}
+
+//离光源近时按立体角采样，否则按面积（或发光贴图的uv分布）采样，pdf_value和random必须走同一个分支
+double xy_rect::pdf_value(const vec3& o, const vec3& v) const {
+    hit_record rec;
+    if (!hit(ray(o, v), 0.001, infinity, rec))
+        return 0;
+    spherical_rect sq(vec3(x0, y0, k), vec3(x1 - x0, 0, 0), vec3(0, y1 - y0, 0), o);
+    if (sq.usable(mp.get()))
+        return 1 / sq.solid_angle;
+    return rect_pdf(v, rec, (x1 - x0) * (y1 - y0));
+}
+
+double xz_rect::pdf_value(const vec3& o, const vec3& v) const {
+    hit_record rec;
+    if (!hit(ray(o, v), 0.001, infinity, rec))
+        return 0;
+    spherical_rect sq(vec3(x0, k, z0), vec3(x1 - x0, 0, 0), vec3(0, 0, z1 - z0), o);
+    if (sq.usable(mp.get()))
+        return 1 / sq.solid_angle;
+    return rect_pdf(v, rec, (x1 - x0) * (z1 - z0));
+}
+
+double yz_rect::pdf_value(const vec3& o, const vec3& v) const {
+    hit_record rec;
+    if (!hit(ray(o, v), 0.001, infinity, rec))
+        return 0;
+    spherical_rect sq(vec3(k, y0, z0), vec3(0, y1 - y0, 0), vec3(0, 0, z1 - z0), o);
+    if (sq.usable(mp.get()))
+        return 1 / sq.solid_angle;
+    return rect_pdf(v, rec, (y1 - y0) * (z1 - z0));
+}
+
+vec3 xy_rect::random(const vec3& o) const {
+    spherical_rect sq(vec3(x0, y0, k), vec3(x1 - x0, 0, 0), vec3(0, y1 - y0, 0), o);
+    if (sq.usable(mp.get()))
+        return sq.sample(random_double(), random_double()) - o;
+    double u, v;
+    sample_emission_uv(mp.get(), u, v);
+    return vec3(x0 + u * (x1 - x0), y0 + v * (y1 - y0), k) - o;
+}
+
+vec3 xz_rect::random(const vec3& o) const {
+    spherical_rect sq(vec3(x0, k, z0), vec3(x1 - x0, 0, 0), vec3(0, 0, z1 - z0), o);
+    if (sq.usable(mp.get()))
+        return sq.sample(random_double(), random_double()) - o;
+    double u, v;
+    sample_emission_uv(mp.get(), u, v);
+    return vec3(x0 + u * (x1 - x0), k, z0 + v * (z1 - z0)) - o;
+}
+
+vec3 yz_rect::random(const vec3& o) const {
+    spherical_rect sq(vec3(k, y0, z0), vec3(0, y1 - y0, 0), vec3(0, 0, z1 - z0), o);
+    if (sq.usable(mp.get()))
+        return sq.sample(random_double(), random_double()) - o;
+    double u, v;
+    sample_emission_uv(mp.get(), u, v);
+    return vec3(k, y0 + u * (y1 - y0), z0 + v * (z1 - z0)) - o;
+}
+
+
+//在矩形上取uv对应的点，法线和hit中的outward_normal相同
+bool xy_rect::sample_point(hit_record& rec, double& pdf) const {
+    pdf = sample_emission_uv(mp.get(), rec.u, rec.v) / ((x1 - x0) * (y1 - y0));
+    rec.p = vec3(x0 + rec.u * (x1 - x0), y0 + rec.v * (y1 - y0), k);
+    rec.normal = vec3(0, 0, 1);
+    rec.front_face = true;
+    rec.mat_ptr = mp.get();
+    rec.object = this;
+    return true;
+}
+
+bool xz_rect::sample_point(hit_record& rec, double& pdf) const {
+    pdf = sample_emission_uv(mp.get(), rec.u, rec.v) / ((x1 - x0) * (z1 - z0));
+    rec.p = vec3(x0 + rec.u * (x1 - x0), k, z0 + rec.v * (z1 - z0));
+    rec.normal = vec3(0, 1, 0);
+    rec.front_face = true;
+    rec.mat_ptr = mp.get();
+    rec.object = this;
+    return true;
+}
+
+bool yz_rect::sample_point(hit_record& rec, double& pdf) const {
+    pdf = sample_emission_uv(mp.get(), rec.u, rec.v) / ((y1 - y0) * (z1 - z0));
+    rec.p = vec3(k, y0 + rec.u * (y1 - y0), z0 + rec.v * (z1 - z0));
+    rec.normal = vec3(1, 0, 0);
+    rec.front_face = true;
+    rec.mat_ptr = mp.get();
+    rec.object = this;
+    return true;
+}
+
+double xy_rect::pdf_point(const vec3& p) const {
+    return emission_uv_pdf(mp.get(), (p.x() - x0) / (x1 - x0), (p.y() - y0) / (y1 - y0)) / ((x1 - x0) * (y1 - y0));
+}
+
+double xz_rect::pdf_point(const vec3& p) const {
+    return emission_uv_pdf(mp.get(), (p.x() - x0) / (x1 - x0), (p.z() - z0) / (z1 - z0)) / ((x1 - x0) * (z1 - z0));
+}
+
+double yz_rect::pdf_point(const vec3& p) const {
+    return emission_uv_pdf(mp.get(), (p.y() - y0) / (y1 - y0), (p.z() - z0) / (z1 - z0)) / ((y1 - y0) * (z1 - z0));
+}
 
 #endif // !AreaLight_H
 
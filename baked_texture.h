@@ -0,0 +1,120 @@
+#ifndef BakedTexture_H
+#define BakedTexture_H
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "texture.h"
+#include "boundingBox.h"
+
+/*
+*把只和位置有关的程序纹理（噪声、大理石等）在场景加载时预先算到包围盒内的三维网格上，
+*渲染时做三线性插值，不再每次着色都求噪声。
+*resolution是最长边上的格点数，越大越接近原纹理，但烘焙时间和内存也越多。
+*包围盒之外的点仍然调用原纹理
+*/
+class baked_texture : public texture {
+public:
+    baked_texture() {}
+    baked_texture(shared_ptr<texture> src, const aabb& box, int resolution = 64)
+        : source(src), bounds(box) {
+        bake(resolution);
+    }
+
+    virtual vec3 value(double u, double v, const vec3& p) const {
+        if (samples.empty())
+            return source->value(u, v, p);
+
+        double x = (p.x() - bounds.min().x()) * scale[0];
+        double y = (p.y() - bounds.min().y()) * scale[1];
+        double z = (p.z() - bounds.min().z()) * scale[2];
+        //只在包围盒内使用烘焙结果，留一点余量给浮点误差
+        const double eps = 1e-4;
+        if (x < -eps || y < -eps || z < -eps || x > n[0] - 1 + eps || y > n[1] - 1 + eps || z > n[2] - 1 + eps)
+            return source->value(u, v, p);
+
+        int i = clamp_cell(x, n[0]), j = clamp_cell(y, n[1]), k = clamp_cell(z, n[2]);
+        float fx = static_cast<float>(x - i), fy = static_cast<float>(y - j), fz = static_cast<float>(z - k);
+        float c[3] = { 0, 0, 0 };
+        for (int dk = 0; dk < 2; dk++) {
+            float wz = dk ? fz : 1 - fz;
+            for (int dj = 0; dj < 2; dj++) {
+                float wyz = wz * (dj ? fy : 1 - fy);
+                const float* s0 = &samples[3 * index(i, j + dj, k + dk)];
+                const float* s1 = s0 + 3;
+                for (int a = 0; a < 3; a++)
+                    c[a] += wyz * ((1 - fx) * s0[a] + fx * s1[a]);
+            }
+        }
+        return vec3(c[0], c[1], c[2]);
+    }
+
+    size_t memory_used() const { return samples.size() * sizeof(float); }
+
+public:
+    shared_ptr<texture> source;
+    aabb bounds;
+
+private:
+    //每个轴上的格点数
+    int n[3] = { 0, 0, 0 };
+    //世界坐标到格点坐标的缩放
+    double scale[3] = { 0, 0, 0 };
+    std::vector<float> samples;
+
+    size_t index(int i, int j, int k) const {
+        return i + size_t(n[0]) * (j + size_t(n[1]) * k);
+    }
+
+    //返回所在格子的起点，保证i+1不越界
+    static int clamp_cell(double x, int count) {
+        int i = static_cast<int>(floor(x));
+        if (i < 0)
+            return 0;
+        return i > count - 2 ? count - 2 : i;
+    }
+
+    void bake(int resolution) {
+        vec3 size = bounds.max() - bounds.min();
+        double longest = ffmax(size.x(), ffmax(size.y(), size.z()));
+        if (resolution < 2 || longest <= 0)
+            return;
+        //格点间距在三个轴上相同
+        for (int a = 0; a < 3; a++) {
+            n[a] = static_cast<int>(ceil(size[a] / longest * (resolution - 1))) + 1;
+            if (n[a] < 2)
+                n[a] = 2;
+            scale[a] = size[a] > 0 ? (n[a] - 1) / size[a] : 0;
+        }
+        samples.resize(size_t(3) * n[0] * n[1] * n[2]);
+
+        //按z方向的切片分给各个线程
+        std::atomic<int> next_slice(0);
+        auto worker = [&]() {
+            int k;
+            while ((k = next_slice.fetch_add(1)) < n[2]) {
+                for (int j = 0; j < n[1]; j++) {
+                    for (int i = 0; i < n[0]; i++) {
+                        vec3 p(bounds.min().x() + (scale[0] > 0 ? i / scale[0] : 0),
+                            bounds.min().y() + (scale[1] > 0 ? j / scale[1] : 0),
+                            bounds.min().z() + (scale[2] > 0 ? k / scale[2] : 0));
+                        vec3 c = source->value(0, 0, p);
+                        float* s = &samples[3 * index(i, j, k)];
+                        s[0] = static_cast<float>(c.x());
+                        s[1] = static_cast<float>(c.y());
+                        s[2] = static_cast<float>(c.z());
+                    }
+                }
+            }
+        };
+        unsigned int thread_count = std::max(1u, std::thread::hardware_concurrency());
+        std::vector<std::thread> workers;
+        for (unsigned int t = 0; t < thread_count; t++)
+            workers.emplace_back(worker);
+        for (auto& w : workers)
+            w.join();
+    }
+};
+
+#endif // !BakedTexture_H
@@ -0,0 +1,423 @@
+#ifndef BDPT_H
+#define BDPT_H
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include "camera.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "light_sampler.h"
+#include "environment.h"
+#include "framebuffer.h"
+
+//光线追踪到相机的贡献可能落在任意像素上，多个线程同时累加，用CAS实现float的原子加法
+class splat_buffer {
+public:
+    splat_buffer(int w, int h) : w(w), h(h), data(new std::atomic<float>[size_t(3) * w * h]) {
+        clear();
+    }
+
+    void add(int x, int y, const vec3& c) {
+        if (x < 0 || x >= w || y < 0 || y >= h)
+            return;
+        std::atomic<float>* p = &data[3 * (size_t(y) * w + x)];
+        for (int k = 0; k < 3; k++) {
+            if (c[k] == 0)
+                continue;
+            float old = p[k].load(std::memory_order_relaxed);
+            while (!p[k].compare_exchange_weak(old, old + static_cast<float>(c[k]), std::memory_order_relaxed)) {}
+        }
+    }
+
+    //把这一遍的贡献加到胶片上，不增加采样数
+    void flush_to(framebuffer& film) {
+        for (int j = 0; j < h; j++) {
+            for (int i = 0; i < w; i++) {
+                const std::atomic<float>* p = &data[3 * (size_t(j) * w + i)];
+                film.add_samples(i, j, vec3(p[0].load(), p[1].load(), p[2].load()), 0);
+            }
+        }
+        clear();
+    }
+
+    void clear() {
+        for (size_t k = 0; k < size_t(3) * w * h; k++)
+            data[k].store(0, std::memory_order_relaxed);
+    }
+
+private:
+    int w, h;
+    std::unique_ptr<std::atomic<float>[]> data;
+};
+
+//子路径上的一个顶点
+struct bdpt_vertex {
+    enum vertex_type { camera_vertex, light_vertex, surface_vertex };
+
+    vertex_type type = surface_vertex;
+    //从子路径起点到这个顶点的吞吐量
+    vec3 beta;
+    //相机顶点只用到p；光源顶点的normal是发光一侧的法线
+    hit_record rec;
+    //到达该顶点的光线，材质求值时作为入射光线
+    ray r_in;
+    //scatter得到的反照率
+    vec3 albedo;
+    //镜面反射/折射，不能和其他顶点连接
+    bool delta = false;
+    //沿子路径正向和反向生成该顶点的面积pdf
+    double pdf_fwd = 0;
+    double pdf_rev = 0;
+
+    const vec3& p() const { return rec.p; }
+    bool on_surface() const { return type != camera_vertex; }
+};
+
+/*
+*双向路径追踪：每个像素采样分别从相机和光源各走一条子路径，
+*再把两条子路径上的顶点两两连接，按balance heuristic给所有连接方式加权。
+*s、t为光源和相机子路径上取用的顶点数，t=1时把光源子路径直接连到相机上，贡献写入splat_buffer。
+*相机按针孔处理（忽略光圈），环境光只由相机子路径逃出场景时累加，不参与连接
+*/
+class bdpt_integrator {
+public:
+    bdpt_integrator(const camera& cam, const hittable& world, const hittable_list& lights,
+        const environment_map& background, int max_depth, int width, int height)
+        : cam(cam), world(world), emitters(lights), background(background),
+        max_depth(max_depth), width(width), height(height) {}
+
+    //s、t为成像平面上的坐标，返回相机一侧的贡献
+    vec3 sample(double s, double t, splat_buffer& splats) const {
+        std::vector<bdpt_vertex> camera_path, light_path;
+        camera_path.reserve(max_depth + 2);
+        light_path.reserve(max_depth + 1);
+
+        ray r = cam.get_ray_sample(s, t);
+        vec3 L = generate_camera_path(r, camera_path);
+        generate_light_path(r.time(), light_path);
+
+        int nt = static_cast<int>(camera_path.size()), ns = static_cast<int>(light_path.size());
+        for (int ti = 1; ti <= nt; ti++) {
+            for (int si = 0; si <= ns; si++) {
+                int depth = si + ti - 2;
+                if ((si == 1 && ti == 1) || depth < 0 || depth > max_depth)
+                    continue;
+                double fs, ft;
+                vec3 c = connect(light_path, camera_path, si, ti, fs, ft);
+                if (c.x() <= 0 && c.y() <= 0 && c.z() <= 0)
+                    continue;
+                if (ti == 1)
+                    splats.add(static_cast<int>(fs * width), static_cast<int>(ft * height), c);
+                else
+                    L += c;
+            }
+        }
+        return L;
+    }
+
+private:
+    const camera& cam;
+    const hittable& world;
+    //光源子路径的起点要和位置无关，所以按功率选光源
+    power_light_sampler emitters;
+    const environment_map& background;
+    int max_depth;
+    int width, height;
+
+    static bool is_black(const vec3& c) {
+        return c.x() <= 0 && c.y() <= 0 && c.z() <= 0;
+    }
+
+    //让法线朝向入射光线的一侧，和hit时set_face_normal的结果一致
+    static hit_record facing(const hit_record& rec, const vec3& dir) {
+        hit_record r = rec;
+        if (dot(dir, r.normal) > 0) {
+            r.normal = -r.normal;
+            r.front_face = !r.front_face;
+        }
+        return r;
+    }
+
+    //从from到达v、再朝to离开时的BSDF乘cos(to方向)
+    vec3 bsdf_f(const bdpt_vertex& v, const vec3& from, const vec3& to) const {
+        ray r_in(from, v.p() - from, v.r_in.time());
+        hit_record rec = facing(v.rec, r_in.direction());
+        return rec.mat_ptr->eval(r_in, rec, v.albedo, ray(v.p(), to - v.p(), r_in.time()));
+    }
+
+    //从from到达v时，BSDF采样出朝向to的方向的立体角pdf
+    double bsdf_pdf(const bdpt_vertex& v, const vec3& from, const vec3& to) const {
+        ray r_in(from, v.p() - from, v.r_in.time());
+        hit_record rec = facing(v.rec, r_in.direction());
+        return rec.mat_ptr->scattering_pdf(r_in, rec, ray(v.p(), to - v.p(), r_in.time()));
+    }
+
+    //把from处的立体角pdf换算成next处的面积pdf
+    static double convert_density(double pdf, const bdpt_vertex& from, const bdpt_vertex& next) {
+        vec3 w = next.p() - from.p();
+        double dist2 = w.length_squared();
+        if (dist2 == 0)
+            return 0;
+        if (next.on_surface())
+            pdf *= fabs(dot(next.rec.normal, w)) / sqrt(dist2);
+        return pdf / dist2;
+    }
+
+    //光源顶点按cos分布发光，朝next方向的面积pdf
+    static double pdf_light(const bdpt_vertex& v, const bdpt_vertex& next) {
+        vec3 w = unit_vector(next.p() - v.p());
+        return convert_density(fabs(dot(v.rec.normal, w)) / pi, v, next);
+    }
+
+    //从光源出发时采到v这个点的面积pdf
+    double pdf_light_origin(const bdpt_vertex& v) const {
+        int light = emitters.find(v.rec.object);
+        if (light < 0)
+            return 0;
+        return emitters.pmf(v.p(), vec3(0, 0, 0), light) * emitters.light(light)->pdf_point(v.p());
+    }
+
+    //v由prev到达时，生成next的面积pdf
+    double pdf(const bdpt_vertex& v, const bdpt_vertex* prev, const bdpt_vertex& next) const {
+        if (v.type == bdpt_vertex::light_vertex)
+            return pdf_light(v, next);
+        if (v.type == bdpt_vertex::camera_vertex) {
+            double pdf_dir;
+            cam.importance(next.p() - v.p(), pdf_dir);
+            return convert_density(pdf_dir, v, next);
+        }
+        return convert_density(bsdf_pdf(v, prev->p(), next.p()), v, next);
+    }
+
+    bool visible(const vec3& a, const vec3& b, double time) const {
+        vec3 d = b - a;
+        double dist = d.length();
+        return !world.occluded(ray(a, d / dist, time), 0.001, dist - 0.001);
+    }
+
+    //沿r随机游走，把击中的顶点依次加入path。radiance为false时是光源子路径
+    vec3 random_walk(ray r, vec3 beta, double pdf_dir, bool radiance, std::vector<bdpt_vertex>& path, int max_vertices) const {
+        vec3 escaped(0, 0, 0);
+        double pdf_fwd = pdf_dir;
+        while (static_cast<int>(path.size()) < max_vertices) {
+            hit_record rec;
+            if (!world.hit(r, 0.001, infinity, rec)) {
+                if (radiance)
+                    escaped += beta * background.value(r.direction());
+                break;
+            }
+            rec.compute_differentials(r);
+
+            bdpt_vertex v;
+            v.rec = rec;
+            v.r_in = r;
+            v.beta = beta;
+            v.pdf_fwd = convert_density(pdf_fwd, path.back(), v);
+            path.push_back(v);
+            bdpt_vertex& cur = path.back();
+            bdpt_vertex& prev = path[path.size() - 2];
+            if (static_cast<int>(path.size()) >= max_vertices)
+                break;
+
+            scatter_record srec;
+            bool scattered = rec.mat_ptr->scatter(r, rec, srec);
+            cur.albedo = srec.attenuation;
+            if (!scattered)
+                break;
+
+            double pdf_rev;
+            if (srec.is_specular) {
+                cur.delta = true;
+                pdf_fwd = pdf_rev = 0;
+                beta = beta * srec.attenuation;
+            }
+            else {
+                vec3 f = rec.mat_ptr->eval(r, rec, srec.attenuation, srec.scattered);
+                if (is_black(f) || srec.pdf <= 0)
+                    break;
+                pdf_fwd = srec.pdf;
+                beta = beta * f / pdf_fwd;
+                //反向：沿scattered的反方向进入，朝prev离开
+                pdf_rev = bsdf_pdf(cur, cur.p() + srec.scattered.direction(), prev.p());
+            }
+            prev.pdf_rev = convert_density(pdf_rev, cur, prev);
+            r = srec.scattered;
+        }
+        return escaped;
+    }
+
+    //返回逃出场景时累加的环境光
+    vec3 generate_camera_path(const ray& r, std::vector<bdpt_vertex>& path) const {
+        bdpt_vertex v;
+        v.type = bdpt_vertex::camera_vertex;
+        v.rec.p = r.origin();
+        //t=1的连接用相机顶点的快门时间做可见性测试
+        v.r_in = r;
+        v.beta = vec3(1, 1, 1);
+        v.pdf_fwd = 1;
+        path.push_back(v);
+        double pdf_dir;
+        cam.importance(r.direction(), pdf_dir);
+        //针孔相机的We*cos/pdf恰好为1
+        return random_walk(r, vec3(1, 1, 1), pdf_dir, true, path, max_depth + 2);
+    }
+
+    void generate_light_path(double time, std::vector<bdpt_vertex>& path) const {
+        double light_pmf;
+        int light = emitters.sample(vec3(0, 0, 0), vec3(0, 0, 0), random_double(), light_pmf);
+        if (light < 0)
+            return;
+        hit_record rec;
+        double pdf_pos;
+        if (!emitters.light(light)->sample_point(rec, pdf_pos) || pdf_pos <= 0)
+            return;
+        vec3 Le = rec.mat_ptr->emitted(ray(), rec, rec.u, rec.v, rec.p);
+        onb uvw(rec.normal);
+        vec3 dir = uvw.local(random_cosine_direction());
+        double pdf_dir = dot(dir, rec.normal) / pi;
+        if (is_black(Le) || pdf_dir <= 0)
+            return;
+
+        bdpt_vertex v;
+        v.type = bdpt_vertex::light_vertex;
+        v.rec = rec;
+        v.beta = Le / (light_pmf * pdf_pos);
+        v.pdf_fwd = light_pmf * pdf_pos;
+        path.push_back(v);
+        vec3 beta = Le * dot(dir, rec.normal) / (light_pmf * pdf_pos * pdf_dir);
+        random_walk(ray(rec.p, dir, time), beta, pdf_dir, false, path, max_depth + 1);
+    }
+
+    //连接光源子路径的前s个顶点和相机子路径的前t个顶点，返回乘过MIS权重的贡献。
+    //t=1时fs、ft返回在成像平面上的位置
+    vec3 connect(const std::vector<bdpt_vertex>& light_path, const std::vector<bdpt_vertex>& camera_path,
+        int s, int t, double& fs, double& ft) const {
+        const bdpt_vertex& pt = camera_path[t - 1];
+        bdpt_vertex sampled;
+        vec3 L(0, 0, 0);
+
+        if (s == 0) {
+            //相机子路径自己击中光源
+            L = pt.beta * pt.rec.mat_ptr->emitted(pt.r_in, pt.rec, pt.rec.u, pt.rec.v, pt.p());
+        }
+        else if (t == 1) {
+            //光源子路径直接连到相机
+            const bdpt_vertex& qs = light_path[s - 1];
+            if (qs.delta || !cam.project(qs.p(), fs, ft))
+                return L;
+            vec3 to_camera = cam.origin - qs.p();
+            double pdf_dir;
+            double We = cam.importance(-to_camera, pdf_dir);
+            if (We <= 0)
+                return L;
+            double cos_camera = dot(unit_vector(-to_camera), -cam.w);
+            L = qs.beta * bsdf_f(qs, light_path[s - 2].p(), cam.origin) * (We * cos_camera / to_camera.length_squared());
+            if (is_black(L) || !visible(qs.p(), cam.origin, pt.r_in.time()))
+                return vec3(0, 0, 0);
+            sampled.type = bdpt_vertex::camera_vertex;
+            sampled.rec.p = cam.origin;
+        }
+        else if (s == 1) {
+            //在光源上重新采样一点，相当于直接光照
+            if (pt.delta)
+                return L;
+            double light_pmf;
+            int light = emitters.sample(pt.p(), pt.rec.normal, random_double(), light_pmf);
+            if (light < 0)
+                return L;
+            const hittable* emitter = emitters.light(light);
+            ray shadow(pt.p(), unit_vector(emitter->random(pt.p())), pt.r_in.time());
+            double light_pdf = light_pmf * emitter->pdf_value(pt.p(), shadow.direction());
+            hit_record light_rec;
+            //和光源共面时pdf是NaN，写成!(pdf > 0)一并排除
+            if (!(light_pdf > 0) || !emitter->hit(shadow, 0.001, infinity, light_rec))
+                return L;
+            vec3 Le = light_rec.mat_ptr->emitted(shadow, light_rec, light_rec.u, light_rec.v, light_rec.p);
+            L = pt.beta * bsdf_f(pt, camera_path[t - 2].p(), light_rec.p) * Le / light_pdf;
+            if (is_black(L) || world.occluded(shadow, 0.001, light_rec.t - 0.001))
+                return vec3(0, 0, 0);
+            sampled.type = bdpt_vertex::light_vertex;
+            sampled.rec = light_rec;
+            sampled.pdf_fwd = pdf_light_origin(sampled);
+        }
+        else {
+            const bdpt_vertex& qs = light_path[s - 1];
+            if (qs.delta || pt.delta)
+                return L;
+            vec3 d = qs.p() - pt.p();
+            L = qs.beta * bsdf_f(qs, light_path[s - 2].p(), pt.p()) * bsdf_f(pt, camera_path[t - 2].p(), qs.p())
+                * pt.beta / d.length_squared();
+            if (is_black(L) || !visible(pt.p(), qs.p(), pt.r_in.time()))
+                return vec3(0, 0, 0);
+        }
+
+        if (is_black(L))
+            return L;
+        return L * mis_weight(light_path, camera_path, sampled, s, t);
+    }
+
+    //balance heuristic：把其他连接方式生成同一条路径的pdf与当前方式的比值加起来
+    double mis_weight(const std::vector<bdpt_vertex>& light_path, const std::vector<bdpt_vertex>& camera_path,
+        const bdpt_vertex& sampled, int s, int t) const {
+        if (s + t == 2)
+            return 1;
+        //不在lights里的发光物体只能由相机子路径直接击中，其他连接方式都生成不了这条路径
+        if (s == 0 && emitters.find(camera_path[t - 1].rec.object) < 0)
+            return 1;
+
+        //t=1或s=1时，连接点是重新采样的顶点
+        const bdpt_vertex& qs_ref = s == 1 ? sampled : light_path[s > 0 ? s - 1 : 0];
+        const bdpt_vertex& pt_ref = t == 1 ? sampled : camera_path[t - 1];
+        const bdpt_vertex* qs = s > 0 ? &qs_ref : nullptr;
+        const bdpt_vertex* pt = &pt_ref;
+        const bdpt_vertex* qs_minus = s > 1 ? &light_path[s - 2] : nullptr;
+        const bdpt_vertex* pt_minus = t > 1 ? &camera_path[t - 2] : nullptr;
+
+        std::vector<double> cam_fwd(t), cam_rev(t), light_fwd(s), light_rev(s);
+        std::vector<char> cam_delta(t), light_delta(s);
+        for (int i = 0; i < t; i++) {
+            const bdpt_vertex& v = i == t - 1 ? *pt : camera_path[i];
+            cam_fwd[i] = v.pdf_fwd;
+            cam_rev[i] = v.pdf_rev;
+            cam_delta[i] = v.delta;
+        }
+        for (int i = 0; i < s; i++) {
+            const bdpt_vertex& v = i == s - 1 ? *qs : light_path[i];
+            light_fwd[i] = v.pdf_fwd;
+            light_rev[i] = v.pdf_rev;
+            light_delta[i] = v.delta;
+        }
+
+        //连接处四个顶点的反向pdf要按这次连接重新计算
+        cam_rev[t - 1] = s > 0 ? pdf(*qs, qs_minus, *pt) : pdf_light_origin(*pt);
+        if (pt_minus)
+            cam_rev[t - 2] = s > 0 ? pdf(*pt, qs, *pt_minus) : pdf_light(*pt, *pt_minus);
+        if (qs)
+            light_rev[s - 1] = pdf(*pt, pt_minus, *qs);
+        if (qs_minus)
+            light_rev[s - 2] = pdf(*qs, pt, *qs_minus);
+        cam_delta[t - 1] = false;
+        if (s > 0)
+            light_delta[s - 1] = false;
+
+        //pdf为0表示这个顶点不能由对应的方式生成（比如镜面），按1处理
+        auto remap0 = [](double f) { return f != 0 ? f : 1; };
+        double sum = 0, ri = 1;
+        for (int i = t - 1; i > 0; i--) {
+            ri *= remap0(cam_rev[i]) / remap0(cam_fwd[i]);
+            if (!cam_delta[i] && !cam_delta[i - 1])
+                sum += ri;
+        }
+        ri = 1;
+        for (int i = s - 1; i >= 0; i--) {
+            ri *= remap0(light_rev[i]) / remap0(light_fwd[i]);
+            bool delta_prev = i > 0 && light_delta[i - 1];
+            if (!light_delta[i] && !delta_prev)
+                sum += ri;
+        }
+        return 1 / (1 + sum);
+    }
+};
+
+#endif // !BDPT_H
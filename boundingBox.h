@@ -32,7 +32,7 @@ public:
 };
 
 
-//ϲΧ
+//合并包围盒
 inline aabb surrounding_box(aabb box0, aabb box1) {
 
     vec3 small(ffmin(box0.min().x(), box1.min().x()),
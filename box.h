@@ -11,6 +11,7 @@ public:
 	box(const vec3& p0, const vec3& p1, shared_ptr<material> ptr);
 
 	virtual bool hit(const ray& r, double t0, double t1, hit_record& rec) const;
+	virtual bool occluded(const ray& r, double t0, double t1) const;
 
 	virtual bool bounding_box(double t0, double t1, aabb& output_box) const {
 		output_box = aabb(box_min, box_max);
@@ -42,15 +43,25 @@ bool box::hit(const ray& r, double t0, double t1, hit_record& rec) const {
 	return sides.hit(r, t0, t1, rec);
 }
 
+bool box::occluded(const ray& r, double t0, double t1) const {
+	return sides.occluded(r, t0, t1);
+}
+
 
-//ƶ
+//移动类
 class translate : public hittable {
 public:
 	translate(shared_ptr<hittable> p, const vec3& displacement)
 		: ptr(p), offset(displacement) {}
 
 	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
+	virtual bool occluded(const ray& r, double t_min, double t_max) const;
 	virtual bool bounding_box(double t0, double t1, aabb& output_box) const;
+	virtual bool light_info(light_bounds& lb) const;
+	virtual double pdf_value(const vec3& o, const vec3& v) const;
+	virtual vec3 random(const vec3& o) const;
+	virtual bool sample_point(hit_record& rec, double& pdf) const;
+	virtual double pdf_point(const vec3& p) const;
 
 public:
 	shared_ptr<hittable> ptr;
@@ -64,10 +75,16 @@ bool translate::hit(const ray& r, double t_min, double t_max, hit_record& rec) c
 
 	rec.p += offset;
 	rec.set_face_normal(moved_r, rec.normal);
+	rec.object = this;
 
 	return true;
 }
 
+bool translate::occluded(const ray& r, double t_min, double t_max) const {
+	ray moved_r(r.origin() - offset, r.direction(), r.time());
+	return ptr->occluded(moved_r, t_min, t_max);
+}
+
 bool translate::bounding_box(double t0, double t1, aabb& output_box) const {
 	if (!ptr->bounding_box(t0, t1, output_box))
 		return false;
@@ -79,12 +96,45 @@ bool translate::bounding_box(double t0, double t1, aabb& output_box) const {
 	return true;
 }
 
-//ת
+bool translate::light_info(light_bounds& lb) const {
+	if (!ptr->light_info(lb))
+		return false;
+	lb.bounds = aabb(lb.bounds.min() + offset, lb.bounds.max() + offset);
+	return true;
+}
+
+double translate::pdf_value(const vec3& o, const vec3& v) const {
+	return ptr->pdf_value(o - offset, v);
+}
+
+vec3 translate::random(const vec3& o) const {
+	return ptr->random(o - offset);
+}
+
+bool translate::sample_point(hit_record& rec, double& pdf) const {
+	if (!ptr->sample_point(rec, pdf))
+		return false;
+	rec.p += offset;
+	rec.object = this;
+	return true;
+}
+
+double translate::pdf_point(const vec3& p) const {
+	return ptr->pdf_point(p - offset);
+}
+
+//旋转类
 class rotate_y : public hittable {
 public:
 	rotate_y(shared_ptr<hittable> p, double angle);
 
 	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
+	virtual bool occluded(const ray& r, double t_min, double t_max) const;
+	virtual bool light_info(light_bounds& lb) const;
+	virtual double pdf_value(const vec3& o, const vec3& v) const;
+	virtual vec3 random(const vec3& o) const;
+	virtual bool sample_point(hit_record& rec, double& pdf) const;
+	virtual double pdf_point(const vec3& p) const;
 	virtual bool bounding_box(double t0, double t1, aabb& output_box) const {
 		output_box = bbox;
 		return hasbox;
@@ -133,7 +183,7 @@ rotate_y::rotate_y(shared_ptr<hittable> p, double angle) : ptr(p) {
 bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
 	vec3 origin = r.origin();
 	vec3 direction = r.direction();
-	//Թת
+	//对光线旋转
 	origin[0] = cos_theta * r.origin()[0] - sin_theta * r.origin()[2];
 	origin[2] = sin_theta * r.origin()[0] + cos_theta * r.origin()[2];
 	direction[0] = cos_theta * r.direction()[0] - sin_theta * r.direction()[2];
@@ -147,7 +197,7 @@ bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
 	vec3 p = rec.p;
 	vec3 normal = rec.normal;
 
-	//תԷ޸
+	//旋转后对法向量做修改
 	p[0] = cos_theta * rec.p[0] + sin_theta * rec.p[2];
 	p[2] = -sin_theta * rec.p[0] + cos_theta * rec.p[2];
 	normal[0] = cos_theta * rec.normal[0] + sin_theta * rec.normal[2];
@@ -156,7 +206,78 @@ bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
 	rec.p = p;
 	rec.set_face_normal(rotated_r, normal);
 
+	vec3 dpdu = rec.dpdu;
+	vec3 dpdv = rec.dpdv;
+	rec.dpdu[0] = cos_theta * dpdu[0] + sin_theta * dpdu[2];
+	rec.dpdu[2] = -sin_theta * dpdu[0] + cos_theta * dpdu[2];
+	rec.dpdv[0] = cos_theta * dpdv[0] + sin_theta * dpdv[2];
+	rec.dpdv[2] = -sin_theta * dpdv[0] + cos_theta * dpdv[2];
+	rec.object = this;
+
+	return true;
+}
+
+bool rotate_y::occluded(const ray& r, double t_min, double t_max) const {
+	vec3 origin = r.origin();
+	vec3 direction = r.direction();
+	origin[0] = cos_theta * r.origin()[0] - sin_theta * r.origin()[2];
+	origin[2] = sin_theta * r.origin()[0] + cos_theta * r.origin()[2];
+	direction[0] = cos_theta * r.direction()[0] - sin_theta * r.direction()[2];
+	direction[2] = sin_theta * r.direction()[0] + cos_theta * r.direction()[2];
+
+	return ptr->occluded(ray(origin, direction, r.time()), t_min, t_max);
+}
+
+bool rotate_y::light_info(light_bounds& lb) const {
+	if (!ptr->light_info(lb))
+		return false;
+	lb.bounds = bbox;
+	vec3 w = lb.w;
+	lb.w[0] = cos_theta * w[0] + sin_theta * w[2];
+	lb.w[2] = -sin_theta * w[0] + cos_theta * w[2];
 	return true;
 }
 
+//把o和v转到物体空间求pdf
+double rotate_y::pdf_value(const vec3& o, const vec3& v) const {
+	vec3 origin = o;
+	vec3 direction = v;
+	origin[0] = cos_theta * o[0] - sin_theta * o[2];
+	origin[2] = sin_theta * o[0] + cos_theta * o[2];
+	direction[0] = cos_theta * v[0] - sin_theta * v[2];
+	direction[2] = sin_theta * v[0] + cos_theta * v[2];
+	return ptr->pdf_value(origin, direction);
+}
+
+vec3 rotate_y::random(const vec3& o) const {
+	vec3 origin = o;
+	origin[0] = cos_theta * o[0] - sin_theta * o[2];
+	origin[2] = sin_theta * o[0] + cos_theta * o[2];
+	vec3 d = ptr->random(origin);
+	vec3 direction = d;
+	direction[0] = cos_theta * d[0] + sin_theta * d[2];
+	direction[2] = -sin_theta * d[0] + cos_theta * d[2];
+	return direction;
+}
+
+//物体空间的点和法线转回世界坐标
+bool rotate_y::sample_point(hit_record& rec, double& pdf) const {
+	if (!ptr->sample_point(rec, pdf))
+		return false;
+	vec3 p = rec.p, n = rec.normal;
+	rec.p[0] = cos_theta * p[0] + sin_theta * p[2];
+	rec.p[2] = -sin_theta * p[0] + cos_theta * p[2];
+	rec.normal[0] = cos_theta * n[0] + sin_theta * n[2];
+	rec.normal[2] = -sin_theta * n[0] + cos_theta * n[2];
+	rec.object = this;
+	return true;
+}
+
+double rotate_y::pdf_point(const vec3& p) const {
+	vec3 q = p;
+	q[0] = cos_theta * p[0] - sin_theta * p[2];
+	q[2] = sin_theta * p[0] + cos_theta * p[2];
+	return ptr->pdf_point(q);
+}
+
 #endif // !Box_H
@@ -15,6 +15,7 @@ public:
         
 
     virtual bool hit(const ray& r, double tmin, double tmax, hit_record& rec) const override;
+    virtual bool occluded(const ray& r, double tmin, double tmax) const override;
     virtual bool bounding_box(double t0, double t1, aabb& output_box) const override;
 
 public:
@@ -23,11 +24,11 @@ public:
     aabb box;
 };
 
-//Գָ   
+//对场景物体分割   
 bvh_node::bvh_node(std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end, double time0, double time1)   
 {
     int axis = random_int(0, 3);
-    //ָ븳ֵ
+    //函数指针赋值
     auto comparator = (axis == 0) ? box_x_compare : (axis == 1) ? box_y_compare : box_z_compare;
 
     size_t object_span = end - start;
@@ -77,6 +78,16 @@ bool bvh_node::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
     return hit_left || hit_right;
 }
 
+//左子树被遮挡时不再遍历右子树
+bool bvh_node::occluded(const ray& r, double t_min, double t_max) const {
+    if (!box.hit(r, t_min, t_max))
+        return false;
+
+    if (left->occluded(r, t_min, t_max))
+        return true;
+    return left != right && right->occluded(r, t_min, t_max);
+}
+
 
 #endif // !BVH
 
@@ -29,21 +29,33 @@ public:
 
         horizontal = 2 * half_width * focus_dist * u;
         vertical = 2 * half_height * focus_dist * v;
+        focus = focus_dist;
+        //距离为1处成像平面的面积
+        plane_area = 4 * half_width * half_height;
     }
 
-    ray get_ray(double s, double t) {
+    //ds、dt为一个像素在s、t方向上的跨度，不为0时同时生成光线微分
+    ray get_ray(double s, double t, double ds = 0, double dt = 0) const {
         vec3 rd = lens_radius * random_in_unit_disk();
         vec3 offset = u * rd.x() + v * rd.y();
+        vec3 target = lower_left_corner + s * horizontal + t * vertical;
 
-        return ray(
+        ray r(
             origin + offset,
-            lower_left_corner + s * horizontal + t * vertical - origin - offset,
+            target - origin - offset,
             random_double(time0, time1)
         );
+        if (ds > 0 || dt > 0) {
+            r.has_differentials = true;
+            r.rx_origin = r.ry_origin = r.orig;
+            r.rx_direction = r.dir + ds * horizontal;
+            r.ry_direction = r.dir + dt * vertical;
+        }
+        return r;
     }
 
-    //һڷ߲
-    ray get_ray_sample(double s, double t) {
+    //向一个像素内发射多条光线采样
+    ray get_ray_sample(double s, double t) const {
         return ray(
             origin,
             lower_left_corner + s * horizontal + t * vertical - origin,
@@ -51,6 +63,31 @@ public:
         );
     }
 
+    //把p投影到成像平面上，s、t在[0,1)内时返回true。只考虑针孔相机
+    bool project(const vec3& p, double& s, double& t) const {
+        vec3 d = p - origin;
+        double z = dot(d, -w);
+        if (z <= 0)
+            return false;
+        vec3 on_plane = origin + d * (focus / z) - lower_left_corner;
+        s = dot(on_plane, horizontal) / horizontal.length_squared();
+        t = dot(on_plane, vertical) / vertical.length_squared();
+        return s >= 0 && s < 1 && t >= 0 && t < 1;
+    }
+
+    //针孔相机沿dir方向的重要性We=1/(A*cos^4)，pdf_dir=1/(A*cos^3)为生成该方向的立体角pdf，
+    //A是距离为1处成像平面的面积，dir在画面外时两者都为0
+    double importance(const vec3& dir, double& pdf_dir) const {
+        pdf_dir = 0;
+        double s, t;
+        if (!project(origin + dir, s, t))
+            return 0;
+        double cos_theta = dot(unit_vector(dir), -w);
+        double cos2 = cos_theta * cos_theta;
+        pdf_dir = 1 / (plane_area * cos2 * cos_theta);
+        return 1 / (plane_area * cos2 * cos2);
+    }
+
 public:
     vec3 origin;
     vec3 lower_left_corner;
@@ -59,5 +96,7 @@ public:
     vec3 u, v, w;
     double lens_radius;
     double time0, time1;  // shutter open/close times
+    double focus;
+    double plane_area;
 };
 #endif
\ No newline at end of file
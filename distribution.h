@@ -0,0 +1,177 @@
+#ifndef Distribution_H
+#define Distribution_H
+
+#include <algorithm>
+#include <vector>
+#include "rtweekend.h"
+
+/*
+*Walker别名表：把n个权重整理成n个桶，每个桶最多放两个结果，
+*采样时先均匀选桶再和桶内的阈值比较，O(1)完成离散采样
+*/
+class alias_table {
+public:
+    alias_table() {}
+    explicit alias_table(const std::vector<double>& weights) { build(weights); }
+
+    void build(const std::vector<double>& weights) {
+        size_t n = weights.size();
+        bins.assign(n, bin());
+        double sum = 0;
+        for (double w : weights)
+            sum += ffmax(w, 0.0);
+        if (n == 0 || sum <= 0) {
+            bins.clear();
+            return;
+        }
+        for (size_t i = 0; i < n; i++)
+            bins[i].p = ffmax(weights[i], 0.0) / sum;
+
+        //按平均值1把桶分成偏小和偏大两组，偏小的桶用偏大的补满（Vose的做法）
+        std::vector<size_t> under, over;
+        std::vector<double> q(n);
+        for (size_t i = 0; i < n; i++) {
+            q[i] = bins[i].p * n;
+            (q[i] < 1 ? under : over).push_back(i);
+        }
+        while (!under.empty() && !over.empty()) {
+            size_t u = under.back(), o = over.back();
+            under.pop_back();
+            over.pop_back();
+            bins[u].q = q[u];
+            bins[u].alias = static_cast<int>(o);
+            q[o] -= 1 - q[u];
+            (q[o] < 1 ? under : over).push_back(o);
+        }
+        //剩下的桶由于浮点误差可能不严格等于1，直接填满
+        for (size_t i : under) {
+            bins[i].q = 1;
+            bins[i].alias = -1;
+        }
+        for (size_t i : over) {
+            bins[i].q = 1;
+            bins[i].alias = -1;
+        }
+    }
+
+    bool empty() const { return bins.empty(); }
+    int size() const { return static_cast<int>(bins.size()); }
+    double pmf(int i) const { return bins[i].p; }
+
+    //u在[0,1)之间，remapped返回桶内剩下的随机数，可以继续使用
+    int sample(double u, double& pmf, double* remapped = nullptr) const {
+        if (bins.empty())
+            return -1;
+        double x = u * bins.size();
+        int offset = std::min(static_cast<int>(x), size() - 1);
+        double up = ffmin(x - offset, 0.99999999999999989);
+        int result = offset;
+        if (up >= bins[offset].q) {
+            result = bins[offset].alias;
+            if (remapped)
+                *remapped = ffmin((up - bins[offset].q) / (1 - bins[offset].q), 0.99999999999999989);
+        }
+        else if (remapped) {
+            *remapped = ffmin(up / bins[offset].q, 0.99999999999999989);
+        }
+        pmf = bins[result].p;
+        return result;
+    }
+
+private:
+    struct bin {
+        //选中桶之后留在本桶的概率、另一个结果，以及本结果的真实概率
+        double q = 0;
+        int alias = -1;
+        double p = 0;
+    };
+    std::vector<bin> bins;
+};
+
+//[0,1]上的分段常数分布，用CDF反演采样
+class distribution_1d {
+public:
+    distribution_1d() {}
+    explicit distribution_1d(const std::vector<double>& f) : func(f), cdf(f.size() + 1) {
+        size_t n = func.size();
+        cdf[0] = 0;
+        for (size_t i = 0; i < n; i++) {
+            func[i] = fabs(func[i]);
+            cdf[i + 1] = cdf[i] + func[i] / n;
+        }
+        func_int = cdf[n];
+        //全为0时退化为均匀分布
+        for (size_t i = 1; i <= n; i++)
+            cdf[i] = func_int > 0 ? cdf[i] / func_int : double(i) / n;
+    }
+
+    int count() const { return static_cast<int>(func.size()); }
+    double integral() const { return func_int; }
+
+    //返回[0,1)上的采样值，pdf是相对[0,1]的密度，offset为所在的段
+    double sample(double u, double& pdf, int& offset) const {
+        offset = static_cast<int>(std::upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin()) - 1;
+        offset = std::max(0, std::min(offset, count() - 1));
+        double du = u - cdf[offset];
+        if (cdf[offset + 1] - cdf[offset] > 0)
+            du /= cdf[offset + 1] - cdf[offset];
+        pdf = func_int > 0 ? func[offset] / func_int : 1;
+        return ffmin((offset + du) / count(), 0.99999999999999989);
+    }
+
+    double pdf(double x) const {
+        int offset = std::max(0, std::min(static_cast<int>(x * count()), count() - 1));
+        return func_int > 0 ? func[offset] / func_int : 1;
+    }
+
+    double value(int i) const { return func[i]; }
+
+private:
+    std::vector<double> func;
+    std::vector<double> cdf;
+    double func_int = 0;
+};
+
+/*
+*[0,1]^2上的分段常数分布，f按行存放（nu列、nv行）。
+*先按每行的积分采样v，再在该行的条件分布中采样u
+*/
+class distribution_2d {
+public:
+    distribution_2d() {}
+    distribution_2d(const std::vector<double>& f, int nu, int nv) {
+        std::vector<double> marginal_func(nv);
+        conditional.reserve(nv);
+        for (int v = 0; v < nv; v++) {
+            conditional.emplace_back(std::vector<double>(f.begin() + size_t(v) * nu, f.begin() + size_t(v + 1) * nu));
+            marginal_func[v] = conditional[v].integral();
+        }
+        marginal = distribution_1d(marginal_func);
+    }
+
+    bool empty() const { return conditional.empty(); }
+
+    //返回(u,v)，pdf是相对uv面积的密度
+    void sample(double u1, double u2, double& u, double& v, double& pdf) const {
+        double pdf_u, pdf_v;
+        int iv, iu;
+        v = marginal.sample(u2, pdf_v, iv);
+        u = conditional[iv].sample(u1, pdf_u, iu);
+        pdf = pdf_u * pdf_v;
+    }
+
+    double pdf(double u, double v) const {
+        int nu = conditional[0].count(), nv = marginal.count();
+        int iu = std::max(0, std::min(static_cast<int>(u * nu), nu - 1));
+        int iv = std::max(0, std::min(static_cast<int>(v * nv), nv - 1));
+        if (marginal.integral() <= 0)
+            return 1;
+        return conditional[iv].value(iu) / marginal.integral();
+    }
+
+private:
+    std::vector<distribution_1d> conditional;
+    distribution_1d marginal;
+};
+
+#endif // !Distribution_H
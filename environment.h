@@ -0,0 +1,150 @@
+#ifndef Environment_H
+#define Environment_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include "vec3.h"
+#include "distribution.h"
+#include "stb_image.h"
+
+/*
+*无穷远处的环境光。可以是常量颜色，也可以是经纬度（equirectangular）排布的HDR贴图，
+*+y朝上，贴图第0行对应天顶。
+*加载贴图时按亮度乘sin(theta)建二维分布，直接光照时按亮度对方向做重要性采样
+*/
+class environment_map {
+public:
+    environment_map() {}
+    explicit environment_map(const vec3& c) : color(c) {}
+    //scale用来整体调节HDR的亮度，读取失败时退回到常量颜色
+    environment_map(const std::string& filename, double scale = 1, const vec3& fallback = vec3(0, 0, 0))
+        : color(fallback) {
+        load(filename, scale);
+    }
+
+    bool textured() const { return !pixels.empty(); }
+    //全黑的环境不需要做直接光照采样
+    bool black() const { return !textured() && color.x() <= 0 && color.y() <= 0 && color.z() <= 0; }
+
+    vec3 value(const vec3& direction) const {
+        if (!textured())
+            return color;
+        double u, v;
+        direction_to_uv(unit_vector(direction), u, v);
+        return bilerp(u, v);
+    }
+
+    //按亮度采样一个方向，返回该方向的辐亮度，pdf是立体角上的密度
+    vec3 sample(double u1, double u2, vec3& direction, double& pdf) const {
+        if (!textured()) {
+            direction = random_unit_vector();
+            pdf = 1 / (4 * pi);
+            return color;
+        }
+        double u, v, uv_pdf;
+        distribution.sample(u1, u2, u, v, uv_pdf);
+        direction = uv_to_direction(u, v);
+        double sin_theta = sin(v * pi);
+        pdf = sin_theta > 0 ? uv_pdf / (2 * pi * pi * sin_theta) : 0;
+        return bilerp(u, v);
+    }
+
+    double pdf(const vec3& direction) const {
+        if (!textured())
+            return 1 / (4 * pi);
+        double u, v;
+        vec3 d = unit_vector(direction);
+        direction_to_uv(d, u, v);
+        double sin_theta = sqrt(ffmax(1 - d.y() * d.y(), 0.0));
+        return sin_theta > 0 ? distribution.pdf(u, v) / (2 * pi * pi * sin_theta) : 0;
+    }
+
+public:
+    //没有贴图时的颜色
+    vec3 color;
+
+private:
+    int nx = 0, ny = 0;
+    //线性空间的RGB
+    std::vector<float> pixels;
+    distribution_2d distribution;
+
+    static void direction_to_uv(const vec3& d, double& u, double& v) {
+        u = 0.5 + atan2(d.x(), -d.z()) / (2 * pi);
+        v = acos(clamp(d.y(), -1.0, 1.0)) / pi;
+    }
+
+    static vec3 uv_to_direction(double u, double v) {
+        double phi = (u - 0.5) * 2 * pi, theta = v * pi;
+        double sin_theta = sin(theta);
+        return vec3(sin_theta * sin(phi), cos(theta), -sin_theta * cos(phi));
+    }
+
+    const float* texel(int i, int j) const {
+        //u方向首尾相接，v方向在两极截断
+        i = ((i % nx) + nx) % nx;
+        j = j < 0 ? 0 : (j > ny - 1 ? ny - 1 : j);
+        return &pixels[3 * (size_t(j) * nx + i)];
+    }
+
+    vec3 bilerp(double u, double v) const {
+        double x = u * nx - 0.5, y = v * ny - 0.5;
+        int i = static_cast<int>(floor(x)), j = static_cast<int>(floor(y));
+        double fx = x - i, fy = y - j;
+        const float *t00 = texel(i, j), *t10 = texel(i + 1, j), *t01 = texel(i, j + 1), *t11 = texel(i + 1, j + 1);
+        double c[3];
+        for (int k = 0; k < 3; k++) {
+            double top = t00[k] + fx * (t10[k] - t00[k]);
+            double bottom = t01[k] + fx * (t11[k] - t01[k]);
+            c[k] = top + fy * (bottom - top);
+        }
+        return vec3(c[0], c[1], c[2]);
+    }
+
+    bool load(const std::string& filename, double scale) {
+        int n;
+        //.hdr直接读出线性值，LDR图片由stb_image按gamma 2.2转换
+        float* data = stbi_loadf(filename.c_str(), &nx, &ny, &n, 3);
+        if (data == nullptr) {
+            std::cerr << "Cannot load environment map " << filename << "\n";
+            nx = ny = 0;
+            return false;
+        }
+        pixels.assign(data, data + size_t(3) * nx * ny);
+        stbi_image_free(data);
+        for (float& p : pixels)
+            p = static_cast<float>(p * scale);
+        build_distribution();
+        return true;
+    }
+
+    //分布最多取1024x512个格子，每格取所含像素的平均亮度，再乘该行的sin(theta)抵消两极面积的压缩
+    void build_distribution() {
+        int nu = nx < 1024 ? nx : 1024, nv = ny < 512 ? ny : 512;
+        std::vector<double> f(size_t(nu) * nv, 0);
+        for (int j = 0; j < ny; j++) {
+            int cv = static_cast<int>(static_cast<long long>(j) * nv / ny);
+            for (int i = 0; i < nx; i++) {
+                int cu = static_cast<int>(static_cast<long long>(i) * nu / nx);
+                const float* p = &pixels[3 * (size_t(j) * nx + i)];
+                f[size_t(cv) * nu + cu] += luminance(vec3(p[0], p[1], p[2]));
+            }
+        }
+        double sum = 0;
+        for (int v = 0; v < nv; v++) {
+            double sin_theta = sin((v + 0.5) / nv * pi);
+            for (int u = 0; u < nu; u++) {
+                f[size_t(v) * nu + u] *= sin_theta;
+                sum += f[size_t(v) * nu + u];
+            }
+        }
+        //双线性插值会把亮度带到相邻的暗格子里，留一点概率保证它们也能采到
+        double floor_value = sum > 0 ? 0.01 * sum / f.size() : 1;
+        for (double& x : f)
+            x += floor_value;
+        distribution = distribution_2d(f, nu, nv);
+    }
+};
+
+#endif // !Environment_H
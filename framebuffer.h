@@ -0,0 +1,347 @@
+#ifndef FrameBuffer_H
+#define FrameBuffer_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "rtweekend.h"
+#include "vec3.h"
+#include "tgaimage.h"
+
+//写进断点的渲染设置，和当前设置不一致的断点不能续渲
+struct render_settings {
+    std::int32_t integrator = 0;
+    std::int32_t max_depth = 0;
+    //按位记录的渲染选项
+    std::int32_t options = 0;
+    std::int32_t reserved = 0;
+    //场景指纹，场景改动后旧断点不再匹配
+    std::uint64_t scene = 0;
+
+    bool operator==(const render_settings& o) const {
+        return integrator == o.integrator && max_depth == o.max_depth && options == o.options && scene == o.scene;
+    }
+    bool operator!=(const render_settings& o) const { return !(*this == o); }
+};
+
+//浮点累积缓冲区，每个像素保存颜色总和和采样数，输出时再做色调映射和量化
+class framebuffer {
+public:
+    //tile边长，一个tile的数据在内存中连续，多线程按tile写入时不会互相抢占缓存行
+    static const int tile_size = 16;
+
+    struct pixel {
+        float r = 0, g = 0, b = 0;
+        //已经累积的采样数
+        unsigned int samples = 0;
+    };
+
+    framebuffer() {}
+    framebuffer(int w, int h) : w(w), h(h) {
+        tiles_x = (w + tile_size - 1) / tile_size;
+        tiles_y = (h + tile_size - 1) / tile_size;
+        data.assign(size_t(tiles_x) * tiles_y * tile_size * tile_size, pixel());
+    }
+
+    int width() const { return w; }
+    int height() const { return h; }
+    int tile_count() const { return tiles_x * tiles_y; }
+    int tiles_per_row() const { return tiles_x; }
+
+    //tile覆盖的像素范围[x0,x1) x [y0,y1)
+    void tile_bounds(int tile, int& x0, int& y0, int& x1, int& y1) const {
+        x0 = (tile % tiles_x) * tile_size;
+        y0 = (tile / tiles_x) * tile_size;
+        x1 = x0 + tile_size < w ? x0 + tile_size : w;
+        y1 = y0 + tile_size < h ? y0 + tile_size : h;
+    }
+
+    //tile优先的存储下标：先定位tile，再在tile内部按行排列
+    size_t index(int x, int y) const {
+        size_t tile = size_t(y / tile_size) * tiles_x + x / tile_size;
+        return tile * tile_size * tile_size + (y % tile_size) * tile_size + x % tile_size;
+    }
+
+    //累加n个采样的颜色总和
+    void add_samples(int x, int y, const vec3& sum, int n = 1) {
+        pixel& p = data[index(x, y)];
+        p.r += float(sum.x());
+        p.g += float(sum.y());
+        p.b += float(sum.z());
+        p.samples += n;
+    }
+
+    const pixel& at(int x, int y) const { return data[index(x, y)]; }
+
+    //像素的平均辐射度
+    vec3 average(int x, int y) const {
+        const pixel& p = at(x, y);
+        if (p.samples == 0)
+            return vec3(0, 0, 0);
+        double scale = 1.0 / p.samples;
+        return vec3(p.r * scale, p.g * scale, p.b * scale);
+    }
+
+    //gamma校正后量化到8位
+    TGAColor tonemap(int x, int y) const {
+        vec3 c = average(x, y);
+        auto r = sqrt(c.x());
+        auto g = sqrt(c.y());
+        auto b = sqrt(c.z());
+        return TGAColor(256 * clamp(r, 0.0, 0.999), 256 * clamp(g, 0.0, 0.999), 256 * clamp(b, 0.0, 0.999));
+    }
+
+    //把第j行按BGR字节写入row，供TGA流式写出
+    void write_row(int j, std::uint8_t* row) const {
+        for (int i = 0; i < w; i++)
+            memcpy(row + 3 * i, tonemap(i, j).bgra, 3);
+    }
+
+    void write_to(TGAImage& image) const {
+        for (int j = 0; j < h; j++)
+            for (int i = 0; i < w; i++)
+                image.set(i, j, tonemap(i, j));
+    }
+
+    void clear() {
+        data.assign(data.size(), pixel());
+    }
+
+    //浮点图像输出，逐行从累积缓冲区计算平均值后直接写入文件，不保留HDR以外的中间图像
+    bool write_pfm_file(const std::string filename) const;
+    //OpenEXR单层扫描线、无压缩格式，half=true时每个通道用16位半精度浮点
+    bool write_exr_file(const std::string filename, const bool half = true) const;
+
+    //断点文件：累积缓冲区原样写出，再加上已完成的遍数、随机数种子和渲染设置
+    bool write_checkpoint(const std::string filename, int passes, std::uint64_t seed, const render_settings& settings) const;
+    bool read_checkpoint(const std::string filename, int& passes, std::uint64_t& seed, const render_settings& settings);
+
+public:
+    std::vector<pixel> data;
+
+private:
+    int w = 0;
+    int h = 0;
+    int tiles_x = 0;
+    int tiles_y = 0;
+};
+
+//float转IEEE半精度，溢出截断为无穷大，尾数按就近偶数舍入
+inline std::uint16_t float_to_half(float value) {
+    std::uint32_t f;
+    memcpy(&f, &value, sizeof(f));
+    std::uint32_t sign = (f >> 16) & 0x8000;
+    std::int32_t exponent = std::int32_t((f >> 23) & 0xff) - 127 + 15;
+    std::uint32_t mantissa = f & 0x7fffff;
+
+    if (((f >> 23) & 0xff) == 0xff)
+        return std::uint16_t(sign | 0x7c00 | (mantissa ? 0x200 : 0));
+    if (exponent >= 31)
+        return std::uint16_t(sign | 0x7c00);
+    if (exponent <= 0) {
+        //非规格化数
+        if (exponent < -10)
+            return std::uint16_t(sign);
+        mantissa |= 0x800000;
+        int shift = 14 - exponent;
+        std::uint32_t half = mantissa >> shift;
+        std::uint32_t rest = mantissa & ((1u << shift) - 1);
+        std::uint32_t halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1)))
+            half++;
+        return std::uint16_t(sign | half);
+    }
+    std::uint32_t half = sign | (std::uint32_t(exponent) << 10) | (mantissa >> 13);
+    //进位可能溢出到指数位，结果仍然正确
+    std::uint32_t rest = mantissa & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+        half++;
+    return std::uint16_t(half);
+}
+
+bool framebuffer::write_pfm_file(const std::string filename) const {
+    std::ofstream out;
+    out.open(filename, std::ios::binary);
+    if (!out.is_open()) {
+        std::cerr << "can't open file " << filename << "\n";
+        return false;
+    }
+    //比例因子为负表示小端序；PFM从最下面一行开始存储，和缓冲区的行顺序一致
+    out << "PF\n" << w << " " << h << "\n-1.0\n";
+    std::vector<float> row(size_t(w) * 3);
+    for (int j = 0; j < h; j++) {
+        for (int i = 0; i < w; i++) {
+            vec3 c = average(i, j);
+            row[3 * i + 0] = float(c.x());
+            row[3 * i + 1] = float(c.y());
+            row[3 * i + 2] = float(c.z());
+        }
+        out.write(reinterpret_cast<const char*>(row.data()), row.size() * sizeof(float));
+    }
+    if (!out.good()) {
+        std::cerr << "can't dump the pfm file\n";
+        out.close();
+        return false;
+    }
+    out.close();
+    return true;
+}
+
+//EXR头部属性：名称、类型、数据长度、数据
+inline void exr_attribute(std::ofstream& out, const char* name, const char* type, const void* value, std::int32_t size) {
+    out.write(name, strlen(name) + 1);
+    out.write(type, strlen(type) + 1);
+    out.write(reinterpret_cast<const char*>(&size), sizeof(size));
+    out.write(reinterpret_cast<const char*>(value), size);
+}
+
+bool framebuffer::write_exr_file(const std::string filename, const bool half) const {
+    std::ofstream out;
+    out.open(filename, std::ios::binary);
+    if (!out.is_open()) {
+        std::cerr << "can't open file " << filename << "\n";
+        return false;
+    }
+    const std::uint8_t magic[8] = { 0x76, 0x2f, 0x31, 0x01, 2, 0, 0, 0 };
+    out.write(reinterpret_cast<const char*>(magic), sizeof(magic));
+
+    //通道按名称字母序排列：B G R
+    const std::int32_t pixel_type = half ? 1 : 2;
+    const int channel_bytes = half ? 2 : 4;
+    std::string channels;
+    for (const char* name : { "B", "G", "R" }) {
+        channels.append(name, 2);
+        std::int32_t fields[4] = { pixel_type, 0, 1, 1 };
+        channels.append(reinterpret_cast<const char*>(fields), sizeof(fields));
+    }
+    channels.push_back('\0');
+    exr_attribute(out, "channels", "chlist", channels.data(), std::int32_t(channels.size()));
+
+    const std::uint8_t compression = 0;
+    exr_attribute(out, "compression", "compression", &compression, 1);
+    const std::int32_t window[4] = { 0, 0, w - 1, h - 1 };
+    exr_attribute(out, "dataWindow", "box2i", window, sizeof(window));
+    exr_attribute(out, "displayWindow", "box2i", window, sizeof(window));
+    const std::uint8_t line_order = 0;
+    exr_attribute(out, "lineOrder", "lineOrder", &line_order, 1);
+    const float aspect = 1.0f;
+    exr_attribute(out, "pixelAspectRatio", "float", &aspect, sizeof(aspect));
+    const float center[2] = { 0.0f, 0.0f };
+    exr_attribute(out, "screenWindowCenter", "v2f", center, sizeof(center));
+    exr_attribute(out, "screenWindowWidth", "float", &aspect, sizeof(aspect));
+    out.put('\0');
+
+    //无压缩时每个块只有一行，块大小固定，偏移表可以直接算出来，不需要回写
+    const std::int32_t row_bytes = w * 3 * channel_bytes;
+    std::uint64_t offset = std::uint64_t(out.tellp()) + std::uint64_t(h) * sizeof(std::uint64_t);
+    for (int y = 0; y < h; y++) {
+        out.write(reinterpret_cast<const char*>(&offset), sizeof(offset));
+        offset += 2 * sizeof(std::int32_t) + row_bytes;
+    }
+
+    //EXR第0行在最上面，缓冲区第0行在最下面
+    std::vector<char> row(row_bytes);
+    for (std::int32_t y = 0; y < h; y++) {
+        int j = h - 1 - y;
+        for (int i = 0; i < w; i++) {
+            vec3 c = average(i, j);
+            for (int ch = 0; ch < 3; ch++) {
+                //B G R分别取颜色的第2、1、0个分量
+                float value = float(c[2 - ch]);
+                char* dst = row.data() + (size_t(ch) * w + i) * channel_bytes;
+                if (half) {
+                    std::uint16_t bits = float_to_half(value);
+                    memcpy(dst, &bits, sizeof(bits));
+                }
+                else
+                    memcpy(dst, &value, sizeof(value));
+            }
+        }
+        out.write(reinterpret_cast<const char*>(&y), sizeof(y));
+        out.write(reinterpret_cast<const char*>(&row_bytes), sizeof(row_bytes));
+        out.write(row.data(), row.size());
+    }
+    if (!out.good()) {
+        std::cerr << "can't dump the exr file\n";
+        out.close();
+        return false;
+    }
+    out.close();
+    return true;
+}
+
+struct checkpoint_header {
+    char magic[4] = { 'R','T','C','K' };
+    std::uint32_t version = 2;
+    std::int32_t width = 0;
+    std::int32_t height = 0;
+    std::int32_t tile = framebuffer::tile_size;
+    std::int32_t passes = 0;
+    std::uint64_t seed = 0;
+    render_settings settings;
+};
+
+bool framebuffer::write_checkpoint(const std::string filename, int passes, std::uint64_t seed, const render_settings& settings) const {
+    //先写临时文件再替换，进程在写入过程中被杀掉也不会损坏上一个断点
+    std::string temp = filename + ".tmp";
+    std::ofstream out;
+    out.open(temp, std::ios::binary);
+    if (!out.is_open()) {
+        std::cerr << "can't open file " << temp << "\n";
+        return false;
+    }
+    checkpoint_header header;
+    header.width = w;
+    header.height = h;
+    header.passes = passes;
+    header.seed = seed;
+    header.settings = settings;
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(data.data()), data.size() * sizeof(pixel));
+    if (!out.good()) {
+        std::cerr << "can't dump the checkpoint file\n";
+        out.close();
+        return false;
+    }
+    out.close();
+    //直接覆盖旧文件，不先删除，任何时刻磁盘上都有一个完整的断点
+    return replace_file(temp, filename);
+}
+
+bool framebuffer::read_checkpoint(const std::string filename, int& passes, std::uint64_t& seed, const render_settings& settings) {
+    std::ifstream in;
+    in.open(filename, std::ios::binary);
+    //没有断点文件是正常情况，直接从头开始
+    if (!in.is_open())
+        return false;
+    checkpoint_header header;
+    checkpoint_header expected;
+    in.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!in.good() || memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 || header.version != expected.version) {
+        std::cerr << "bad checkpoint file " << filename << "\n";
+        return false;
+    }
+    if (header.width != w || header.height != h || header.tile != tile_size) {
+        std::cerr << "checkpoint " << filename << " is " << header.width << "x" << header.height << ", ignored\n";
+        return false;
+    }
+    if (header.settings != settings) {
+        std::cerr << "checkpoint " << filename << " was rendered with a different integrator, depth, options or scene, ignored\n";
+        return false;
+    }
+    std::vector<pixel> loaded(data.size());
+    in.read(reinterpret_cast<char*>(loaded.data()), loaded.size() * sizeof(pixel));
+    if (!in.good()) {
+        std::cerr << "an error occured while reading the checkpoint\n";
+        return false;
+    }
+    data.swap(loaded);
+    passes = header.passes;
+    seed = header.seed;
+    return true;
+}
+
+#endif // !FrameBuffer_H
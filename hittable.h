@@ -5,39 +5,109 @@
 #include "boundingBox.h"
 
 class material;
+class hittable;
+
+//光源的包围盒、发光方向范围和功率，用于光源BVH估计光源对着色点的贡献
+struct light_bounds {
+    aabb bounds;
+    //发光方向锥的轴
+    vec3 w;
+    //功率。形状只填面积，材质的发光强度由光源采样器乘上去
+    double phi = 0;
+    //所有表面法线与w的最大夹角theta_o的cos
+    double cos_theta_o = 1;
+    //法线之外还会发光的角度theta_e的cos，漫射面光源为pi/2
+    double cos_theta_e = 0;
+    bool two_sided = false;
+    const material* mat = nullptr;
+};
 
 struct hit_record {
-    //ཻĵ
+    //相交的点
     vec3 p;
-    //ཻķ
+    //相交点的法向量
     vec3 normal;
-    //
-    shared_ptr<material> mat_ptr;
-    //ͼuv
+    //材质类
+    const material* mat_ptr = nullptr;
+    //击中的物体，用于判断是否击中了某个光源
+    const hittable* object = nullptr;
+    //贴图uv
     double u, v;
-    //೤ʱ
+    //经过多长时间
     double t;
-    //жϷ߳
+    //判断法线朝向
     bool front_face;
+    //交点位置对uv的偏导，用于把光线微分换算成贴图空间的范围
+    vec3 dpdu, dpdv;
+    //一个像素在uv空间覆盖的宽度，没有光线微分时为0
+    double uv_width = 0;
 
     /*
-    *뽻㷨߷ͬ߷ȡ
+    *入射光线与交点法线方向朝向相同，则法线方向取反
     */
 	inline void set_face_normal(const ray& r, const vec3& outward_normal) 
     {
 		front_face = dot(r.direction(), outward_normal) < 0;
 		normal = front_face ? outward_normal : -outward_normal;
 	}
+
+    /*
+    *把两条微分光线与交点切平面求交，得到相邻像素在表面上的偏移，
+    *再用dpdu、dpdv解出uv的偏移量
+    */
+    void compute_differentials(const ray& r)
+    {
+        uv_width = 0;
+        if (!r.has_differentials)
+            return;
+
+        double d = dot(normal, p);
+        double tx = (d - dot(normal, r.rx_origin)) / dot(normal, r.rx_direction);
+        double ty = (d - dot(normal, r.ry_origin)) / dot(normal, r.ry_direction);
+        if (!std::isfinite(tx) || !std::isfinite(ty))
+            return;
+        vec3 dpdx = r.rx_origin + tx * r.rx_direction - p;
+        vec3 dpdy = r.ry_origin + ty * r.ry_direction - p;
+
+        //去掉法线分量最大的轴，在剩下两个轴上解2x2方程
+        int dim0 = 0, dim1 = 1;
+        if (fabs(normal.x()) > fabs(normal.y()) && fabs(normal.x()) > fabs(normal.z()))
+            dim0 = 1, dim1 = 2;
+        else if (fabs(normal.y()) > fabs(normal.z()))
+            dim0 = 0, dim1 = 2;
+
+        double det = dpdu[dim0] * dpdv[dim1] - dpdv[dim0] * dpdu[dim1];
+        if (fabs(det) < 1e-12)
+            return;
+        double dudx = (dpdv[dim1] * dpdx[dim0] - dpdv[dim0] * dpdx[dim1]) / det;
+        double dvdx = (dpdu[dim0] * dpdx[dim1] - dpdu[dim1] * dpdx[dim0]) / det;
+        double dudy = (dpdv[dim1] * dpdy[dim0] - dpdv[dim0] * dpdy[dim1]) / det;
+        double dvdy = (dpdu[dim0] * dpdy[dim1] - dpdu[dim1] * dpdy[dim0]) / det;
+        uv_width = ffmax(sqrt(dudx * dudx + dvdx * dvdx), sqrt(dudy * dudy + dvdy * dvdy));
+    }
 };
 
 class hittable {
 public:
-    //ڼǷཻཻϢ
+    //用于计算光线是否与物体相交，并保存相交点的信息
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const = 0;
+    //阴影光线的遮挡查询，找到任意一个交点即返回，不填写hit_record
+    virtual bool occluded(const ray& r, double t_min, double t_max) const = 0;
     virtual bool bounding_box(double t0, double t1, aabb& output_box) const = 0;
+
+    //作为光源时的信息，不能作为光源采样的物体返回false
+    virtual bool light_info(light_bounds& lb) const { return false; }
+    //从o点看向v方向时，按random(o)采样的方向的pdf（立体角）
+    virtual double pdf_value(const vec3& o, const vec3& v) const { return 0; }
+    //从o点指向物体上随机一点的方向
+    virtual vec3 random(const vec3& o) const { return vec3(1, 0, 0); }
+    //在表面上按面积（发光贴图有uv分布时按uv分布）采样一点，rec.normal为发光一侧的法线，pdf为面积上的密度
+    virtual bool sample_point(hit_record& rec, double& pdf) const { return false; }
+    //sample_point采到表面上p点的面积pdf
+    virtual double pdf_point(const vec3& p) const { return 0; }
 };
 
-//޸ķ߳
+//用于修改法线朝向的类
 class flip_face : public hittable {
 public:
     flip_face(shared_ptr<hittable> p) : ptr(p) {}
@@ -47,13 +117,46 @@ public:
             return false;
 
         rec.front_face = !rec.front_face;
+        rec.object = this;
         return true;
     }
 
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+        return ptr->occluded(r, t_min, t_max);
+    }
+
     virtual bool bounding_box(double t0, double t1, aabb& output_box) const override {
         return ptr->bounding_box(t0, t1, output_box);
     }
 
+    //发光的一面也跟着翻转
+    virtual bool light_info(light_bounds& lb) const override {
+        if (!ptr->light_info(lb))
+            return false;
+        lb.w = -lb.w;
+        return true;
+    }
+
+    virtual double pdf_value(const vec3& o, const vec3& v) const override {
+        return ptr->pdf_value(o, v);
+    }
+
+    virtual vec3 random(const vec3& o) const override {
+        return ptr->random(o);
+    }
+
+    virtual bool sample_point(hit_record& rec, double& pdf) const override {
+        if (!ptr->sample_point(rec, pdf))
+            return false;
+        rec.normal = -rec.normal;
+        rec.object = this;
+        return true;
+    }
+
+    virtual double pdf_point(const vec3& p) const override {
+        return ptr->pdf_point(p);
+    }
+
 public:
     shared_ptr<hittable> ptr;
 };
@@ -62,10 +165,10 @@ public:
 inline bool box_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis) {
     aabb box_a;
     aabb box_b;
-    //ȡabİΧ
+    //获取a和b的包围盒
     if (!a->bounding_box(0, 0, box_a) || !b->bounding_box(0, 0, box_b))
         std::cerr << "No bounding box in bvh_node constructor.\n";
-    //ݰΧ½λ
+    //根据包围盒左下角位置来排序
     return box_a.min().e[axis] < box_b.min().e[axis];
 }
 
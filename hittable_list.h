@@ -17,6 +17,7 @@ public:
 	void add(shared_ptr<hittable> object) { objects.push_back(object); }
 
 	virtual bool hit(const ray& r, double tmin, double tmax, hit_record& rec) const;
+	virtual bool occluded(const ray& r, double tmin, double tmax) const;
 	virtual bool bounding_box(double t0, double t1, aabb& output_box) const;
 
 public:
@@ -39,13 +40,23 @@ bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& re
 	return hit_anything;
 }
 
+//只要有一个物体遮挡就提前返回
+bool hittable_list::occluded(const ray& r, double t_min, double t_max) const {
+	for (const auto& object : objects) {
+		if (object->occluded(r, t_min, t_max))
+			return true;
+	}
+
+	return false;
+}
+
 bool hittable_list::bounding_box(double t0, double t1, aabb& output_box) const {
 	if (objects.empty()) 
 		return false;
 
 	aabb temp_box;
 	bool first_box = true;
-	//ڰlistİΧкϲ
+	//用于把list中所有物体的包围盒合并
 	for (const auto& object : objects) {
 		if (!object->bounding_box(t0, t1, temp_box)) 
 			return false;
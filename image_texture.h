@@ -1,50 +1,120 @@
 #ifndef ImageTexture_H
 #define ImageTexture_H
 
+#include <cstring>
+#include <string>
 #include "texture.h"
+#include "texture_cache.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TEXTURE_SSE2 1
+#endif
 
 
 class image_texture : public texture {
 public:
     image_texture() {}
-    image_texture(unsigned char* pixels, int A, int B)
-        : data(pixels), nx(A), ny(B) {}
-
-    ~image_texture() {
-        delete data;
+    //像素数据由texture_cache按tile管理，同一个文件只保留一份
+    image_texture(const std::string& filename)
+        : image(texture_cache::instance().open(filename)) {
+        if (image) {
+            nx = image->width();
+            ny = image->height();
+        }
     }
 
+    //没有采样范围时在最精细的一层做双线性插值
     virtual vec3 value(double u, double v, const vec3& p) const {
+        return value(u, v, p, 0);
+    }
+
+    //根据一个像素在uv空间覆盖的宽度选择mipmap层，在相邻两层之间做三线性插值
+    virtual vec3 value(double u, double v, const vec3& p, double width) const {
         // If we have no texture data, then always emit cyan (as a debugging aid).
-        if (data == nullptr)
+        if (!image)
             return vec3(0, 1, 1);
 
-        auto i = static_cast<int>((u)*nx);
-        auto j = static_cast<int>((1 - v) * ny - 0.001);
+        double level = log2(ffmax(width * ffmax(nx, ny), 1e-8));
+        if (level <= 0)
+            return bilerp(0, u, v);
+        int last = static_cast<int>(image->levels.size()) - 1;
+        if (level >= last)
+            return bilerp(last, u, v);
 
-        if (i < 0) 
-            i = 0;
+        int l0 = static_cast<int>(level);
+        double t = level - l0;
+        return (1 - t) * bilerp(l0, u, v) + t * bilerp(l0 + 1, u, v);
+    }
 
-        if (j < 0) 
-            j = 0;
+public:
+    std::shared_ptr<tiled_image> image;
+    int nx = 0, ny = 0;
 
-        if (i > nx - 1) 
-            i = nx - 1;
+private:
+    //下一次查缓存可能替换掉线程缓存里的这个tile，所以把像素拷出来
+    void texel(int level, int i, int j, float* out) const {
+        const texture_tile* tile = texture_cache::instance().tile(*image, level, i / texture_tile::tile_size, j / texture_tile::tile_size);
+        memcpy(out, tile->texel(i % texture_tile::tile_size, j % texture_tile::tile_size), 4 * sizeof(float));
+    }
 
-        if (j > ny - 1) 
-            j = ny - 1;
+    //tile中已经是线性空间的RGBA float，四个像素用SIMD一起插值
+    vec3 bilerp(int level, double u, double v) const {
+        const tiled_image::level_info& m = image->levels[level];
+        //v方向图片第0行在最上面
+        double x = clamp(u, 0.0, 1.0) * m.nx - 0.5;
+        double y = (1 - clamp(v, 0.0, 1.0)) * m.ny - 0.5;
+        int i = static_cast<int>(floor(x));
+        int j = static_cast<int>(floor(y));
+        float fx = static_cast<float>(x - i);
+        float fy = static_cast<float>(y - j);
+        int i0 = i < 0 ? 0 : i, i1 = i + 1 > m.nx - 1 ? m.nx - 1 : i + 1;
+        int j0 = j < 0 ? 0 : j, j1 = j + 1 > m.ny - 1 ? m.ny - 1 : j + 1;
 
-        auto r = static_cast<int>(data[3 * i + 3 * nx * j + 0]) / 255.0;
-        auto g = static_cast<int>(data[3 * i + 3 * nx * j + 1]) / 255.0;
-        auto b = static_cast<int>(data[3 * i + 3 * nx * j + 2]) / 255.0;
+        //四个像素在同一个tile里时只查一次缓存
+        const int ts = texture_tile::tile_size;
+        const float *t00, *t10, *t01, *t11;
+        alignas(16) float c00[4], c10[4], c01[4], c11[4];
+        if (i0 / ts == i1 / ts && j0 / ts == j1 / ts) {
+            const texture_tile* tile = texture_cache::instance().tile(*image, level, i0 / ts, j0 / ts);
+            t00 = tile->texel(i0 % ts, j0 % ts);
+            t10 = tile->texel(i1 % ts, j0 % ts);
+            t01 = tile->texel(i0 % ts, j1 % ts);
+            t11 = tile->texel(i1 % ts, j1 % ts);
+        }
+        else {
+            texel(level, i0, j0, c00);
+            texel(level, i1, j0, c10);
+            texel(level, i0, j1, c01);
+            texel(level, i1, j1, c11);
+            t00 = c00;
+            t10 = c10;
+            t01 = c01;
+            t11 = c11;
+        }
 
-        return vec3(r, g, b);
+#if TEXTURE_SSE2
+        __m128 wx = _mm_set1_ps(fx);
+        __m128 wy = _mm_set1_ps(fy);
+        //vector在C++17之前不保证按alignas(16)分配，用非对齐读取
+        __m128 a = _mm_loadu_ps(t00);
+        __m128 b = _mm_loadu_ps(t01);
+        __m128 top = _mm_add_ps(a, _mm_mul_ps(wx, _mm_sub_ps(_mm_loadu_ps(t10), a)));
+        __m128 bottom = _mm_add_ps(b, _mm_mul_ps(wx, _mm_sub_ps(_mm_loadu_ps(t11), b)));
+        __m128 c = _mm_add_ps(top, _mm_mul_ps(wy, _mm_sub_ps(bottom, top)));
+        alignas(16) float out[4];
+        _mm_store_ps(out, c);
+        return vec3(out[0], out[1], out[2]);
+#else
+        float out[3];
+        for (int k = 0; k < 3; k++) {
+            float top = t00[k] + fx * (t10[k] - t00[k]);
+            float bottom = t01[k] + fx * (t11[k] - t01[k]);
+            out[k] = top + fy * (bottom - top);
+        }
+        return vec3(out[0], out[1], out[2]);
+#endif
     }
-
-public:
-    unsigned char* data;
-    int nx, ny;
 };
 
 #endif // !ImageTexture_H
-
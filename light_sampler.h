@@ -0,0 +1,449 @@
+#ifndef LightSampler_H
+#define LightSampler_H
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include "hittable_list.h"
+#include "material.h"
+#include "distribution.h"
+
+//多重重要性采样的power heuristic，f_pdf为当前策略的pdf
+inline double power_heuristic(double f_pdf, double g_pdf) {
+    double f2 = f_pdf * f_pdf, g2 = g_pdf * g_pdf;
+    if (f2 + g2 == 0)
+        return 0;
+    return f2 / (f2 + g2);
+}
+
+//方向锥，cos_theta为-1时表示整个球面
+struct direction_cone {
+    vec3 w = vec3(0, 0, 1);
+    double cos_theta = 1;
+};
+
+inline double safe_acos(double x) {
+    return acos(clamp(x, -1.0, 1.0));
+}
+
+inline double safe_sqrt(double x) {
+    return sqrt(ffmax(x, 0.0));
+}
+
+//v绕单位轴axis旋转theta弧度
+inline vec3 rotate_about(const vec3& v, const vec3& axis, double theta) {
+    double c = cos(theta), s = sin(theta);
+    return c * v + s * cross(axis, v) + (1 - c) * dot(axis, v) * axis;
+}
+
+//包住两个方向锥的最小方向锥
+inline direction_cone cone_union(const direction_cone& a, const direction_cone& b) {
+    double theta_a = safe_acos(a.cos_theta), theta_b = safe_acos(b.cos_theta);
+    double theta_d = safe_acos(dot(a.w, b.w));
+    if (ffmin(theta_d + theta_b, pi) <= theta_a)
+        return a;
+    if (ffmin(theta_d + theta_a, pi) <= theta_b)
+        return b;
+
+    direction_cone r;
+    double theta_o = (theta_a + theta_d + theta_b) / 2;
+    vec3 axis = cross(a.w, b.w);
+    if (theta_o >= pi || axis.length_squared() == 0) {
+        r.cos_theta = -1;
+        return r;
+    }
+    r.w = unit_vector(rotate_about(a.w, unit_vector(axis), theta_o - theta_a));
+    r.cos_theta = cos(theta_o);
+    return r;
+}
+
+//从p看包围盒所张的方向锥的半角余弦，p在盒内时为整个球面
+inline double bound_subtended_cos(const aabb& b, const vec3& p) {
+    vec3 lo = b.min(), hi = b.max();
+    if (p.x() >= lo.x() && p.x() <= hi.x() && p.y() >= lo.y() && p.y() <= hi.y() && p.z() >= lo.z() && p.z() <= hi.z())
+        return -1;
+    vec3 center = 0.5 * (lo + hi);
+    double radius2 = 0.25 * (hi - lo).length_squared();
+    double d2 = (p - center).length_squared();
+    if (d2 < radius2)
+        return -1;
+    return safe_sqrt(1 - radius2 / d2);
+}
+
+/*
+*一组光源的包围盒、发光方向锥和总功率，用来估计它们对着色点p的贡献上界。
+*cos_theta_o是法线方向锥的半角，cos_theta_e是法线之外还能发光的角度（面光源为pi/2）
+*/
+struct light_bvh_bounds {
+    aabb bounds;
+    vec3 w = vec3(0, 0, 1);
+    double phi = 0;
+    double cos_theta_o = 1;
+    double cos_theta_e = 1;
+    bool two_sided = false;
+
+    vec3 centroid() const { return 0.5 * (bounds.min() + bounds.max()); }
+
+    double importance(const vec3& p, const vec3& n) const {
+        if (phi <= 0)
+            return 0;
+        vec3 pc = centroid();
+        double d2 = (p - pc).length_squared();
+        //点离包围盒很近时距离用包围盒尺寸限制，避免除以接近0的数
+        d2 = ffmax(d2, (bounds.max() - bounds.min()).length() / 2);
+
+        //两个角度相减，结果小于0时按0处理
+        auto cos_sub_clamped = [](double sin_a, double cos_a, double sin_b, double cos_b) {
+            return cos_a > cos_b ? 1.0 : cos_a * cos_b + sin_a * sin_b;
+        };
+        auto sin_sub_clamped = [](double sin_a, double cos_a, double sin_b, double cos_b) {
+            return cos_a > cos_b ? 0.0 : sin_a * cos_b - cos_a * sin_b;
+        };
+
+        vec3 wi = unit_vector(p - pc);
+        double cos_w = dot(w, wi);
+        if (two_sided)
+            cos_w = fabs(cos_w);
+        double sin_w = safe_sqrt(1 - cos_w * cos_w);
+
+        double cos_b = bound_subtended_cos(bounds, p);
+        double sin_b = safe_sqrt(1 - cos_b * cos_b);
+
+        double sin_o = safe_sqrt(1 - cos_theta_o * cos_theta_o);
+        double cos_x = cos_sub_clamped(sin_w, cos_w, sin_o, cos_theta_o);
+        double sin_x = sin_sub_clamped(sin_w, cos_w, sin_o, cos_theta_o);
+        double cos_p = cos_sub_clamped(sin_x, cos_x, sin_b, cos_b);
+        if (cos_p <= cos_theta_e)
+            return 0;
+
+        double result = phi * cos_p / d2;
+        //着色点法线为0时（比如介质中的点）不考虑入射角
+        if (n.length_squared() > 0) {
+            double cos_i = fabs(dot(wi, n));
+            double sin_i = safe_sqrt(1 - cos_i * cos_i);
+            result *= cos_sub_clamped(sin_i, cos_i, sin_b, cos_b);
+        }
+        return ffmax(result, 0.0);
+    }
+};
+
+inline light_bvh_bounds bounds_union(const light_bvh_bounds& a, const light_bvh_bounds& b) {
+    if (a.phi == 0)
+        return b;
+    if (b.phi == 0)
+        return a;
+    direction_cone ca, cb;
+    ca.w = a.w;
+    ca.cos_theta = a.cos_theta_o;
+    cb.w = b.w;
+    cb.cos_theta = b.cos_theta_o;
+    direction_cone c = cone_union(ca, cb);
+
+    light_bvh_bounds r;
+    r.bounds = surrounding_box(a.bounds, b.bounds);
+    r.w = c.w;
+    r.phi = a.phi + b.phi;
+    r.cos_theta_o = c.cos_theta;
+    r.cos_theta_e = ffmin(a.cos_theta_e, b.cos_theta_e);
+    r.two_sided = a.two_sided || b.two_sided;
+    return r;
+}
+
+/*
+*从场景的光源列表中选一个光源做直接光照采样。
+*sample按u选出光源编号并给出选中的概率，pmf给出在p点选中某个光源的概率，供MIS使用
+*/
+class light_sampler {
+public:
+    light_sampler() {}
+    //只保留能提供light_info且功率大于0的物体
+    explicit light_sampler(const hittable_list& list) {
+        for (const auto& object : list.objects) {
+            light_bounds lb;
+            if (!object->light_info(lb) || !lb.mat)
+                continue;
+            //phi是面积乘pi乘平均辐亮度，即朗伯光源的总功率
+            double power = lb.phi * pi * luminance(lb.mat->average_emission());
+            if (power <= 0)
+                continue;
+            lb.phi = power;
+            index[object.get()] = static_cast<int>(lights.size());
+            lights.push_back(object);
+            infos.push_back(lb);
+        }
+    }
+    virtual ~light_sampler() {}
+
+    bool empty() const { return lights.empty(); }
+    int size() const { return static_cast<int>(lights.size()); }
+    const hittable* light(int i) const { return lights[i].get(); }
+
+    //光源在列表中的编号，不是可采样的光源时返回-1
+    int find(const hittable* object) const {
+        auto it = index.find(object);
+        return it == index.end() ? -1 : it->second;
+    }
+
+    //返回-1表示p点没有可能照亮它的光源
+    virtual int sample(const vec3& p, const vec3& n, double u, double& pmf) const {
+        if (lights.empty())
+            return -1;
+        int i = std::min(static_cast<int>(u * lights.size()), size() - 1);
+        pmf = 1.0 / lights.size();
+        return i;
+    }
+
+    virtual double pmf(const vec3& p, const vec3& n, int light) const {
+        return lights.empty() ? 0 : 1.0 / lights.size();
+    }
+
+protected:
+    std::vector<shared_ptr<hittable>> lights;
+    std::vector<light_bounds> infos;
+    std::unordered_map<const hittable*, int> index;
+};
+
+/*
+*按功率选光源，场景加载时建一次别名表，采样是O(1)。
+*不考虑光源到着色点的距离和朝向，适合光源数量少、分布集中的场景
+*/
+class power_light_sampler : public light_sampler {
+public:
+    power_light_sampler() {}
+    explicit power_light_sampler(const hittable_list& list) : light_sampler(list) {
+        std::vector<double> power;
+        for (const auto& lb : infos)
+            power.push_back(lb.phi);
+        table.build(power);
+    }
+
+    virtual int sample(const vec3& p, const vec3& n, double u, double& pmf) const {
+        return table.sample(u, pmf);
+    }
+
+    virtual double pmf(const vec3& p, const vec3& n, int light) const {
+        return light < 0 || table.empty() ? 0 : table.pmf(light);
+    }
+
+private:
+    alias_table table;
+};
+
+/*
+*光源BVH：每个节点记录子树内光源的包围盒、方向锥和总功率。
+*采样时从根往下走，按两个子节点对p点的重要性随机选一边，复杂度为O(log n)。
+*每个光源记下从根到叶子的左右选择（bit_trails），求pmf时沿同一条路径把概率乘起来
+*/
+class bvh_light_sampler : public light_sampler {
+public:
+    bvh_light_sampler() {}
+    explicit bvh_light_sampler(const hittable_list& list) : light_sampler(list) {
+        if (lights.empty())
+            return;
+        std::vector<std::pair<int, light_bvh_bounds>> items;
+        for (int i = 0; i < size(); i++)
+            items.emplace_back(i, to_bvh_bounds(infos[i]));
+        bit_trails.resize(lights.size(), 0);
+        nodes.reserve(2 * lights.size());
+        build(items, 0, items.size(), 0, 0);
+    }
+
+    virtual int sample(const vec3& p, const vec3& n, double u, double& pmf) const {
+        if (nodes.empty())
+            return -1;
+        int node = 0;
+        pmf = 1;
+        while (true) {
+            const light_node& nd = nodes[node];
+            if (nd.leaf) {
+                if (node > 0 || nd.bounds.importance(p, n) > 0)
+                    return nd.child_or_light;
+                return -1;
+            }
+            double c0 = nodes[node + 1].bounds.importance(p, n);
+            double c1 = nodes[nd.child_or_light].bounds.importance(p, n);
+            if (c0 == 0 && c1 == 0)
+                return -1;
+            double p0 = c0 / (c0 + c1);
+            //复用u继续往下选
+            if (u < p0) {
+                node = node + 1;
+                u = ffmin(u / p0, 0.99999999999999989);
+                pmf *= p0;
+            }
+            else {
+                node = nd.child_or_light;
+                u = ffmin((u - p0) / (1 - p0), 0.99999999999999989);
+                pmf *= 1 - p0;
+            }
+        }
+    }
+
+    virtual double pmf(const vec3& p, const vec3& n, int light) const {
+        if (light < 0 || nodes.empty())
+            return 0;
+        //只有一个光源时根节点就是叶子，和sample一样要求它能照到p
+        if (nodes[0].leaf)
+            return nodes[0].bounds.importance(p, n) > 0 ? 1 : 0;
+        std::uint64_t trail = bit_trails[light];
+        int node = 0;
+        double result = 1;
+        while (true) {
+            const light_node& nd = nodes[node];
+            if (nd.leaf)
+                return result;
+            double c0 = nodes[node + 1].bounds.importance(p, n);
+            double c1 = nodes[nd.child_or_light].bounds.importance(p, n);
+            if (c0 + c1 == 0)
+                return 0;
+            if (trail & 1) {
+                result *= c1 / (c0 + c1);
+                node = nd.child_or_light;
+            }
+            else {
+                result *= c0 / (c0 + c1);
+                node = node + 1;
+            }
+            trail >>= 1;
+        }
+    }
+
+private:
+    //左孩子紧跟在父节点后面，child_or_light是右孩子的下标或叶子的光源编号
+    struct light_node {
+        light_bvh_bounds bounds;
+        int child_or_light = 0;
+        bool leaf = false;
+    };
+
+    std::vector<light_node> nodes;
+    std::vector<std::uint64_t> bit_trails;
+
+    static light_bvh_bounds to_bvh_bounds(const light_bounds& lb) {
+        light_bvh_bounds b;
+        b.bounds = lb.bounds;
+        b.w = unit_vector(lb.w);
+        b.phi = lb.phi;
+        b.cos_theta_o = lb.cos_theta_o;
+        b.cos_theta_e = lb.cos_theta_e;
+        b.two_sided = lb.two_sided;
+        return b;
+    }
+
+    //方向锥部分的代价：发光方向覆盖的立体角按cos加权
+    static double orientation_measure(const light_bvh_bounds& b) {
+        double theta_o = safe_acos(b.cos_theta_o), theta_e = safe_acos(b.cos_theta_e);
+        double theta_w = ffmin(theta_o + theta_e, pi);
+        double sin_o = safe_sqrt(1 - b.cos_theta_o * b.cos_theta_o);
+        return 2 * pi * (1 - b.cos_theta_o)
+            + pi / 2 * (2 * theta_w * sin_o - cos(theta_o - 2 * theta_w) - 2 * theta_o * sin_o + b.cos_theta_o);
+    }
+
+    static double surface_area(const aabb& b) {
+        vec3 d = b.max() - b.min();
+        return 2 * (d.x() * d.y() + d.x() * d.z() + d.y() * d.z());
+    }
+
+    //SAOH代价：功率 x 方向锥 x 表面积，再按包围盒在划分轴上的扁平程度修正
+    static double split_cost(const light_bvh_bounds& b, const aabb& parent, int dim) {
+        vec3 d = parent.max() - parent.min();
+        double longest = ffmax(d.x(), ffmax(d.y(), d.z()));
+        double kr = d[dim] > 0 ? longest / d[dim] : 0;
+        return b.phi * orientation_measure(b) * kr * surface_area(b.bounds);
+    }
+
+    static int ceil_log2(size_t n) {
+        int k = 0;
+        while ((size_t(1) << k) < n)
+            k++;
+        return k;
+    }
+
+    int build(std::vector<std::pair<int, light_bvh_bounds>>& items, size_t start, size_t end, std::uint64_t trail, int depth) {
+        if (end - start == 1) {
+            int node = static_cast<int>(nodes.size());
+            light_node leaf;
+            leaf.bounds = items[start].second;
+            leaf.child_or_light = items[start].first;
+            leaf.leaf = true;
+            nodes.push_back(leaf);
+            bit_trails[items[start].first] = trail;
+            return node;
+        }
+
+        aabb bounds = items[start].second.bounds, centroid_bounds(items[start].second.centroid(), items[start].second.centroid());
+        for (size_t i = start + 1; i < end; i++) {
+            bounds = surrounding_box(bounds, items[i].second.bounds);
+            vec3 c = items[i].second.centroid();
+            centroid_bounds = surrounding_box(centroid_bounds, aabb(c, c));
+        }
+
+        //在三个轴上各分12个桶，找SAOH代价最小的划分
+        const int bucket_count = 12;
+        double min_cost = infinity;
+        int min_bucket = -1, min_dim = -1;
+        for (int dim = 0; dim < 3; dim++) {
+            double lo = centroid_bounds.min()[dim], hi = centroid_bounds.max()[dim];
+            if (hi == lo)
+                continue;
+            light_bvh_bounds buckets[bucket_count];
+            for (size_t i = start; i < end; i++) {
+                int b = static_cast<int>(bucket_count * (items[i].second.centroid()[dim] - lo) / (hi - lo));
+                b = std::min(b, bucket_count - 1);
+                buckets[b] = bounds_union(buckets[b], items[i].second);
+            }
+            for (int split = 0; split < bucket_count - 1; split++) {
+                light_bvh_bounds below, above;
+                for (int b = 0; b <= split; b++)
+                    below = bounds_union(below, buckets[b]);
+                for (int b = split + 1; b < bucket_count; b++)
+                    above = bounds_union(above, buckets[b]);
+                double cost = split_cost(below, bounds, dim) + split_cost(above, bounds, dim);
+                if (cost > 0 && cost < min_cost) {
+                    min_cost = cost;
+                    min_bucket = split;
+                    min_dim = dim;
+                }
+            }
+        }
+
+        size_t mid;
+        if (min_dim == -1) {
+            //所有中心重合时按数量对半分
+            mid = (start + end) / 2;
+        }
+        else {
+            double lo = centroid_bounds.min()[min_dim], hi = centroid_bounds.max()[min_dim];
+            auto it = std::partition(items.begin() + start, items.begin() + end, [&](const std::pair<int, light_bvh_bounds>& item) {
+                int b = static_cast<int>(bucket_count * (item.second.centroid()[min_dim] - lo) / (hi - lo));
+                return std::min(b, bucket_count - 1) <= min_bucket;
+            });
+            mid = it - items.begin();
+            if (mid == start || mid == end)
+                mid = (start + end) / 2;
+        }
+        //bit_trails只有64位，叶子最深64层。对半分的子树深度是ceil(log2(n))，
+        //按SAOH划分会超过这个深度时改为按数量对半分
+        if (depth + 1 + ceil_log2(std::max(mid - start, end - mid)) > 64)
+            mid = (start + end) / 2;
+
+        int node = static_cast<int>(nodes.size());
+        nodes.push_back(light_node());
+        build(items, start, mid, trail, depth + 1);
+        int right = build(items, mid, end, trail | (std::uint64_t(1) << depth), depth + 1);
+        nodes[node].child_or_light = right;
+        nodes[node].bounds = bounds_union(nodes[node + 1].bounds, nodes[right].bounds);
+        return node;
+    }
+};
+
+//光源少时遍历BVH的开销比按功率选更大，位置带来的收益也有限
+inline std::unique_ptr<light_sampler> make_light_sampler(const hittable_list& lights, size_t bvh_threshold = 8) {
+    if (lights.objects.size() < bvh_threshold)
+        return std::unique_ptr<light_sampler>(new power_light_sampler(lights));
+    return std::unique_ptr<light_sampler>(new bvh_light_sampler(lights));
+}
+
+#endif // !LightSampler_H
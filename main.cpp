@@ -1,5 +1,7 @@
 ﻿#include <iostream>
 #include<fstream>
+#include <atomic>
+#include <thread>
 
 #include "ray.h"
 #include "rtweekend.h"
@@ -9,7 +11,16 @@
 #include "material.h"
 #include "bvh.h"
 #include "image_texture.h"
+#include "baked_texture.h"
 #include "arealight.h"
+#include "framebuffer.h"
+#include "light_sampler.h"
+#include "environment.h"
+#include "bdpt.h"
+#include "sppm.h"
+#include "radiance_cache.h"
+#include "path_guide.h"
+#include "restir.h"
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
@@ -41,50 +52,121 @@ using namespace std;
 //    return (1.0 - p) * vec3(1.0, 1.0, 1.0) + p * vec3(0.5, 0.7, 1.0);
 //}
 
-vec3 ray_color(const ray& r, const vec3& background, const hittable& world, int depth) {
+//prev_normal和prev_pdf是上一个顶点的法线和按BSDF采样出r的pdf，pdf为0表示来自相机或镜面反射，
+//pdf为负表示上一个顶点对场景光源的直接光照已经由ReSTIR算过。
+//cache不为空时，漫反射点的结果写入辐亮度缓存，经过漫反射之后再击中的点优先从缓存中读取。
+//guide不为空时，朗伯面上的方向部分按学到的入射辐亮度分布采样，训练期间同时记录样本
+vec3 ray_color(const ray& r, const environment_map& background, const hittable& world, const light_sampler& lights, int depth,
+    const vec3& prev_normal = vec3(0, 0, 0), double prev_pdf = 0, radiance_cache* cache = nullptr, path_guide* guide = nullptr) {
     hit_record rec;
 
     // If we've exceeded the ray bounce limit, no more light is gathered.
     if (depth <= 0)
         return vec3(1, 0, 0);
 
-    // 判断光线是否击中物体，如果没有则直接返回黑色
-    if (!world.hit(r, 0.001, infinity, rec))
-        return background;
+    // 判断光线是否击中物体，如果没有则返回环境光，环境光也做过直接光照采样时按MIS加权
+    if (!world.hit(r, 0.001, infinity, rec)) {
+        vec3 env = background.value(r.direction());
+        if (prev_pdf != 0 && !background.black())
+            env = env * power_heuristic(fabs(prev_pdf), background.pdf(r.direction()));
+        return env;
+    }
+    rec.compute_differentials(r);
 
-    ray scattered;
-    vec3 attenuation;
     vec3 emitted = rec.mat_ptr->emitted(r, rec, rec.u, rec.v, rec.p);
-    double pdf = 0;
-    //反照率
-    vec3 albedo;
+    //上一个顶点也可能通过光源采样得到这条路径，用power heuristic给BSDF采样的结果加权
+    if (prev_pdf != 0 && (emitted.x() > 0 || emitted.y() > 0 || emitted.z() > 0)) {
+        int light = lights.find(rec.object);
+        //ReSTIR已经在上一个顶点算过这个光源
+        if (light >= 0 && prev_pdf < 0)
+            emitted = vec3(0, 0, 0);
+        else if (light >= 0) {
+            double light_pdf = lights.pmf(r.origin(), prev_normal, light) * rec.object->pdf_value(r.origin(), r.direction());
+            emitted = emitted * power_heuristic(prev_pdf, light_pdf);
+        }
+    }
 
-    if (!rec.mat_ptr->scatter(r, rec, albedo, scattered, pdf))
-        return emitted;
+    //朗伯面的反射辐亮度与观察方向无关，可以在不同路径之间共用
+    bool cacheable = cache && rec.mat_ptr->type == material_lambertian;
+    vec3 cached;
+    if (cacheable && prev_pdf != 0 && cache->lookup(rec.p, rec.normal, cached))
+        return emitted + cached;
 
-    //面光源上的随机位置
-    auto on_light = vec3(random_double(213, 343), 554, random_double(227, 332));
-    auto to_light = on_light - rec.p;
-    auto distance_squared = to_light.length_squared();
-    to_light = unit_vector(to_light);
+    scatter_record srec;
 
-    if (dot(to_light, rec.normal) < 0)
+    if (!rec.mat_ptr->scatter(r, rec, srec))
         return emitted;
 
-    //面光源面积
-    double light_area = (343 - 213) * (332 - 227);
-    //这里是求面光源法线和on_light之间的cosine值
-    auto light_cosine = fabs(to_light.y());
-    if (light_cosine < 0.000001)
-        return emitted;
+    //镜面反射/折射只能沿着唯一的方向继续追踪，下一次击中光源时要计入全部自发光
+    if (srec.is_specular)
+        return emitted + srec.attenuation * ray_color(srec.scattered, background, world, lights, depth - 1, vec3(0, 0, 0), 0, cache, guide);
 
-    pdf = distance_squared / (light_cosine * light_area);
-    scattered = ray(rec.p, to_light, r.time());
+    //反照率
+    const vec3& albedo = srec.attenuation;
+
+    //路径引导时按fraction的概率改用学到的分布采样，采样pdf换成两者的混合，直接光照的MIS也用混合pdf
+    bool guided = guide && rec.mat_ptr->type == material_lambertian;
+    const guide_dtree* guide_tree = guided ? guide->sampling_tree(rec.p, rec.normal) : nullptr;
+    auto sampling_pdf = [&](const ray& scattered) {
+        double pdf = rec.mat_ptr->scattering_pdf(r, rec, scattered);
+        if (guide_tree)
+            pdf = guide->fraction * path_guide::pdf(*guide_tree, scattered.direction()) + (1 - guide->fraction) * pdf;
+        return pdf;
+    };
+    if (guide_tree) {
+        if (random_double() < guide->fraction)
+            srec.scattered = ray(rec.p, path_guide::sample(*guide_tree, random_double(), random_double()), r.time());
+        srec.pdf = sampling_pdf(srec.scattered);
+    }
+
+    vec3 direct(0, 0, 0);
+    //由光源采样器按重要性选一个光源，再在光源上采样一个方向
+    double light_pmf = 0;
+    int light = lights.sample(rec.p, rec.normal, random_double(), light_pmf);
+    if (light >= 0) {
+        const hittable* emitter = lights.light(light);
+        vec3 to_light = emitter->random(rec.p);
+        //光源在表面背面时由材质的eval返回0，粗糙玻璃可以透射到背面的光源
+        ray shadow(rec.p, unit_vector(to_light), r.time());
+        vec3 f = rec.mat_ptr->eval(r, rec, albedo, shadow);
+        double light_pdf = light_pmf * emitter->pdf_value(rec.p, shadow.direction());
+        hit_record light_rec;
+        //阴影光线只需要知道是否被遮挡，光源本身的交点单独求
+        if ((f.x() > 0 || f.y() > 0 || f.z() > 0) && light_pdf > 0
+            && emitter->hit(shadow, 0.001, infinity, light_rec) && !world.occluded(shadow, 0.001, light_rec.t - 0.001)) {
+            double bsdf_pdf = sampling_pdf(shadow);
+            direct = f * light_rec.mat_ptr->emitted(shadow, light_rec, light_rec.u, light_rec.v, light_rec.p)
+                * (power_heuristic(light_pdf, bsdf_pdf) / light_pdf);
+        }
+    }
+
+    //环境光单独按亮度采样一个方向，和场景中的光源分开与BSDF采样做MIS
+    if (!background.black()) {
+        vec3 to_env;
+        double env_pdf;
+        vec3 Le = background.sample(random_double(), random_double(), to_env, env_pdf);
+        ray shadow(rec.p, to_env, r.time());
+        vec3 f = rec.mat_ptr->eval(r, rec, albedo, shadow);
+        if ((f.x() > 0 || f.y() > 0 || f.z() > 0) && env_pdf > 0 && !world.occluded(shadow, 0.001, infinity)) {
+            double bsdf_pdf = sampling_pdf(shadow);
+            direct += f * Le * (power_heuristic(env_pdf, bsdf_pdf) / env_pdf);
+        }
+    }
 
     //return emitted + attenuation * ray_color(scattered, background, world, depth - 1);
 
-    return emitted + albedo * rec.mat_ptr->scattering_pdf(r, rec, scattered)
-        * ray_color(scattered, background, world, depth - 1) / pdf;
+    //学到的分布覆盖整个球面，采到表面背面的方向时贡献为0，不用继续追踪
+    vec3 reflected = direct;
+    vec3 f = rec.mat_ptr->eval(r, rec, albedo, srec.scattered);
+    if (f.x() > 0 || f.y() > 0 || f.z() > 0) {
+        vec3 incoming = ray_color(srec.scattered, background, world, lights, depth - 1, rec.normal, srec.pdf, cache, guide);
+        reflected += f * incoming / srec.pdf;
+        if (guided && guide->training())
+            guide->record(rec.p, rec.normal, srec.scattered.direction(), luminance(incoming) / srec.pdf);
+    }
+    if (cacheable)
+        cache->update(rec.p, rec.normal, reflected);
+    return emitted + reflected;
 }
 
 hittable_list random_scene() {
@@ -141,14 +223,24 @@ hittable_list random_scene() {
     return static_cast<hittable_list>(make_shared<bvh_node>(world, 0, 1));
 }
 
-hittable_list earth() {
-    int nx, ny, nn;
-    unsigned char* texture_data = stbi_load("earthmap.jpg", &nx, &ny, &nn, 0);
-    if (texture_data == nullptr)
-        cout << "Cannot load texture" << endl;
+//bake_resolution大于0时，小球的纹理预先烘焙到网格上
+hittable_list two_perlin_spheres(int bake_resolution = 128) {
+    hittable_list objects;
+
+    //大理石纹理
+    auto pertext = make_shared<noise_texture>(4, noise_marble);
+    objects.add(make_shared<sphere>(vec3(0, -1000, 0), 1000, make_shared<lambertian>(pertext)));
+    shared_ptr<texture> ball = pertext;
+    if (bake_resolution > 0)
+        ball = make_shared<baked_texture>(pertext, aabb(vec3(-2, 0, -2), vec3(2, 4, 2)), bake_resolution);
+    objects.add(make_shared<sphere>(vec3(0, 2, 0), 2, make_shared<lambertian>(ball)));
 
+    return objects;
+}
+
+hittable_list earth() {
     auto earth_surface =
-        make_shared<lambertian>(make_shared<image_texture>(texture_data, nx, ny));
+        make_shared<lambertian>(make_shared<image_texture>("earthmap.jpg"));
     auto globe = make_shared<sphere>(vec3(0, 0, 0), 2, earth_surface);
 
     hittable_list world;
@@ -156,16 +248,12 @@ hittable_list earth() {
     return hittable_list(world);
 }
 
-hittable_list simple_light() {
+hittable_list simple_light(hittable_list& lights) {
     hittable_list world;
 
-    int nx, ny, nn;
-    unsigned char* texture_data = stbi_load("earthmap.jpg", &nx, &ny, &nn, 0);
-    if (texture_data == nullptr)
-        cout << "Cannot load texture" << endl;
-
+    //和earth()共享texture_cache中同一份贴图
     auto earth_surface =
-        make_shared<lambertian>(make_shared<image_texture>(texture_data, nx, ny));
+        make_shared<lambertian>(make_shared<image_texture>("earthmap.jpg"));
     auto globe = make_shared<sphere>(vec3(0, 1, 0), 1, earth_surface);
     world.add(globe);
 
@@ -178,17 +266,21 @@ hittable_list simple_light() {
 
     //面光源材质
     auto difflight = make_shared<diffuse_light>(make_shared<constant_texture>(vec3(4, 4, 4)));
-    //球形光源
-    world.add(make_shared<sphere>(vec3(0, 3, 0), 1, difflight));
+    //球形光源，表面积是下面面光源的pi倍，按功率选光源时被选中的次数也多
+    auto light_sphere = make_shared<sphere>(vec3(0, 3, 0), 1, difflight);
+    world.add(light_sphere);
+    lights.add(light_sphere);
     //面光源
-    world.add(make_shared<xy_rect>(3, 5, 1, 3, -2, difflight));
+    auto light_rect = make_shared<xy_rect>(3, 5, 1, 3, -2, difflight);
+    world.add(light_rect);
+    lights.add(light_rect);
 
     
 
     return world;
 }
 
-hittable_list cornell_box() {
+hittable_list cornell_box(hittable_list& lights) {
     hittable_list objects;
 
     auto red = make_shared<lambertian>(make_shared<constant_texture>(vec3(0.65, 0.05, 0.05)));
@@ -199,7 +291,9 @@ hittable_list cornell_box() {
     objects.add(make_shared<flip_face>(make_shared<yz_rect>(0, 555, 0, 555, 555, green)));
     objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red));
     //上方的面光源
-    objects.add(make_shared<flip_face>(make_shared<xz_rect>(213, 343, 227, 332, 555, light)));
+    auto light_rect = make_shared<flip_face>(make_shared<xz_rect>(213, 343, 227, 332, 555, light));
+    objects.add(light_rect);
+    lights.add(light_rect);
     objects.add(make_shared<flip_face>(make_shared<xz_rect>(0, 555, 0, 555, 555, white)));
     objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
     objects.add(make_shared<flip_face>(make_shared<xy_rect>(0, 555, 0, 555, 555, white)));
@@ -221,14 +315,92 @@ hittable_list cornell_box() {
     //return objects;
 }
 
-int main() {
+//地面上铺满小的发光球，用来测试大量光源时的光源采样
+hittable_list many_lights(hittable_list& lights, int grid = 16) {
+    hittable_list objects;
+
+    auto ground = make_shared<lambertian>(make_shared<constant_texture>(vec3(0.5, 0.5, 0.5)));
+    objects.add(make_shared<xz_rect>(-1000, 1000, -1000, 1000, 0, ground));
+
+    auto white = make_shared<lambertian>(make_shared<constant_texture>(vec3(0.73, 0.73, 0.73)));
+    objects.add(make_shared<sphere>(vec3(278, 120, 278), 120, white));
+    objects.add(make_shared<sphere>(vec3(420, 60, 120), 60, make_shared<metal>(vec3(0.8, 0.85, 0.88), 0.2)));
+
+    double spacing = 555.0 / grid;
+    for (int i = 0; i < grid; i++) {
+        for (int k = 0; k < grid; k++) {
+            vec3 center((i + 0.5) * spacing, 6, (k + 0.5) * spacing);
+            //和大球重叠的位置不放光源
+            if ((center - vec3(278, 6, 278)).length() < 130)
+                continue;
+            auto color = vec3::random(0.2, 1) * 20;
+            auto light = make_shared<sphere>(center, 5, make_shared<diffuse_light>(make_shared<constant_texture>(color)));
+            objects.add(light);
+            lights.add(light);
+        }
+    }
+
+    return static_cast<hittable_list>(make_shared<bvh_node>(objects, 0, 1));
+}
+
+//场景指纹：光源数和包围盒，再沿三个轴向各发出32x32条平行光线穿过包围盒，记下沿途每个交点的距离。
+//改动场景后指纹随之改变，旧断点不会被误用
+std::uint64_t scene_fingerprint(const hittable& world, const hittable_list& lights) {
+    std::uint64_t h = splitmix64(lights.objects.size());
+    auto mix = [&h](double d) {
+        std::uint64_t bits;
+        memcpy(&bits, &d, sizeof(bits));
+        h = splitmix64(h ^ bits);
+    };
+    aabb box;
+    if (!world.bounding_box(0, 1, box))
+        return h;
+    vec3 lo = box.min(), hi = box.max();
+    for (int a = 0; a < 3; a++) {
+        mix(lo[a]);
+        mix(hi[a]);
+    }
+    const int probes = 32;
+    for (int a = 0; a < 3; a++) {
+        int b = (a + 1) % 3, c = (a + 2) % 3;
+        for (int j = 0; j < probes; j++) {
+            for (int i = 0; i < probes; i++) {
+                vec3 origin, dir(0, 0, 0);
+                origin[a] = lo[a] - 1;
+                origin[b] = lo[b] + (hi[b] - lo[b]) * (i + 0.5) / probes;
+                origin[c] = lo[c] + (hi[c] - lo[c]) * (j + 0.5) / probes;
+                dir[a] = 1;
+                //越过每个交点继续求交，封闭的盒子里面的物体也能被记到
+                hit_record rec;
+                double t = 0.001;
+                for (int k = 0; k < 16 && world.hit(ray(origin, dir), t, infinity, rec); k++) {
+                    mix(rec.t);
+                    t = rec.t + 0.001;
+                }
+            }
+        }
+    }
+    return h;
+}
+
+//积分器，用命令行参数选择，例如 RT6 bdpt
+enum integrator_type { integrator_path, integrator_bdpt, integrator_sppm };
+
+int main(int argc, char* argv[]) {
     const int image_width = 800;
     const int image_height = 600;
     const int samples_per_pixel = 30;
     const int max_depth = 50;
+    //BDPT的连接方式随深度平方增长，路径长度单独限制
+    const int bdpt_max_depth = 8;
+    //每渲染多少遍写一次快照图片和断点
+    const int checkpoint_interval = 8;
+    const char* checkpoint_file = "Image.ckpt";
+    const std::uint64_t random_seed = 0;
     const auto aspect_ratio = double(image_width) / image_height;
 
-    const vec3 background(0, 0, 0);
+    //环境光，室外场景可以换成经纬度排布的HDR贴图：environment_map background("sky.hdr");
+    const environment_map background(vec3(0, 0, 0));
 
     vec3 eye_pos(278, 278, -800);
     vec3 lookat(278, 278, 0);
@@ -238,25 +410,181 @@ int main() {
     auto vfov = 40.0;
 
     camera cam(eye_pos, lookat, vup, vfov, aspect_ratio, aperture, dist_to_focus, 0.0, 1.0);
-    //random_scene cornell_box
-	hittable_list world = cornell_box();
-
-    TGAImage image(image_width, image_height, TGAImage::RGB);
-
-    for (int j = image_height - 1; j >= 0; --j) {
-        std::cerr << "\r剩余进度: " << j << ' ' << std::flush;
-        for (int i = 0; i < image_width; ++i) {
-            vec3 color(0, 0, 0);
-            for (int s = 0; s < samples_per_pixel; ++s) {
-                auto u = (i + random_double()) / image_width;
-                auto v = (j + random_double()) / image_height;
-                ray r = cam.get_ray(u, v);
-                //color += ray_color(r, world, max_depth);
-                color += ray_color(r, background, world, max_depth);
+    //random_scene cornell_box many_lights
+    hittable_list lights;
+	hittable_list world = cornell_box(lights);
+    //光源少时按功率选择，多时按光源BVH选择，每次只对一个光源做直接光照
+    std::unique_ptr<light_sampler> sampler = make_light_sampler(lights);
+
+    //默认用路径追踪；焦散和被遮挡的光源较多时用双向路径追踪，以焦散为主时用SPPM。
+    //路径追踪加上cache参数时启用辐亮度缓存，加上guide参数时启用路径引导，
+    //加上restir参数时第一个交点的直接光照改用ReSTIR，再加上temporal参数时水塘在前后两遍之间复用，例如 RT6 path cache
+    integrator_type integrator = integrator_path;
+    bool use_cache = false;
+    bool use_guide = false;
+    bool use_restir = false;
+    bool use_temporal = false;
+    for (int a = 1; a < argc; a++) {
+        std::string arg = argv[a];
+        if (arg == "path")
+            integrator = integrator_path;
+        else if (arg == "bdpt")
+            integrator = integrator_bdpt;
+        else if (arg == "sppm")
+            integrator = integrator_sppm;
+        else if (arg == "cache")
+            use_cache = true;
+        else if (arg == "guide")
+            use_guide = true;
+        else if (arg == "restir")
+            use_restir = true;
+        else if (arg == "temporal")
+            use_temporal = true;
+        else
+            std::cerr << "Unknown option " << arg << "\n";
+    }
+    bdpt_integrator bdpt(cam, world, lights, background, bdpt_max_depth, image_width, image_height);
+    //BDPT连到相机的贡献落在任意像素上，每遍结束后再加到胶片上
+    splat_buffer splats(image_width, image_height);
+    //缓存的内容和tile的完成顺序有关，多线程下结果不完全确定，也不写进断点
+    std::unique_ptr<radiance_cache> cache;
+    if (use_cache && integrator == integrator_path)
+        cache.reset(new radiance_cache(cam.origin));
+    //前一半的遍数用来训练路径引导，之后分布固定不变。训练结果不在断点里，启用时不续渲
+    std::unique_ptr<path_guide> guide;
+    aabb scene_bounds;
+    if (use_guide && integrator == integrator_path && world.bounding_box(0, 1, scene_bounds))
+        guide.reset(new path_guide(scene_bounds, std::max(1, samples_per_pixel / 2)));
+    //ReSTIR每个像素保存G-buffer和两个水塘
+    std::unique_ptr<restir_di> restir;
+    if (use_restir && integrator == integrator_path)
+        restir.reset(new restir_di(cam, world, *sampler, background, max_depth, image_width, image_height, use_temporal));
+    //SPPM每个像素要保存可见点和统计量，只在选用时创建
+    std::unique_ptr<sppm_integrator> sppm;
+    if (integrator == integrator_sppm)
+        sppm.reset(new sppm_integrator(cam, world, lights, *sampler, background, max_depth, image_width, image_height));
+
+    framebuffer film(image_width, image_height);
+    int pass = 0;
+    std::uint64_t seed = random_seed;
+    render_settings settings;
+    settings.integrator = integrator;
+    settings.max_depth = integrator == integrator_bdpt ? bdpt_max_depth : max_depth;
+    settings.scene = scene_fingerprint(world, lights);
+    //开启后会改变结果的选项各占一位
+    if (cache)
+        settings.options |= 1;
+    if (restir)
+        settings.options |= 2;
+    if (restir && use_temporal)
+        settings.options |= 4;
+    //存在尺寸和渲染设置都匹配的断点时从断点继续，samples_per_pixel调大后可以在原结果上追加采样。
+    //SPPM的像素统计量和路径引导的训练结果不在断点里，不能续渲
+    bool resumable = integrator != integrator_sppm && !guide;
+    if (resumable && film.read_checkpoint(checkpoint_file, pass, seed, settings))
+        std::cerr << "从断点恢复: " << pass << " spp\n";
+
+    //渲染一遍：整幅图像每个像素一个采样，各线程从next_tile中领取tile
+    //传入stream时，一整行tile完成后立即把这些行编码写入文件，不必等整遍结束
+    auto render_pass = [&](int pass, TGAStreamWriter* stream) {
+        if (integrator == integrator_sppm) {
+            //SPPM的估计每遍整体更新，胶片里只放当前结果
+            sppm->iterate(seed + std::uint64_t(pass) * (image_height + image_width * image_height));
+            sppm->write_to(film);
+            return;
+        }
+        //ReSTIR的水塘要在整幅图像上复用，先于tile算好
+        if (restir)
+            restir->prepare(splitmix64(seed + pass));
+        std::atomic<int> next_tile(0);
+        int tile_rows = film.tile_count() / film.tiles_per_row();
+        std::unique_ptr<std::atomic<int>[]> finished_in_row(new std::atomic<int>[tile_rows]);
+        for (int t = 0; t < tile_rows; t++)
+            finished_in_row[t] = 0;
+
+        auto render_tiles = [&]() {
+            std::vector<std::uint8_t> row(image_width * 3);
+            for (int tile = next_tile++; tile < film.tile_count(); tile = next_tile++) {
+                //随机数只由种子、遍数和tile决定，恢复后的结果和不中断时完全相同
+                seed_random(seed + std::uint64_t(pass) * film.tile_count() + tile);
+                int x0, y0, x1, y1;
+                film.tile_bounds(tile, x0, y0, x1, y1);
+                for (int j = y0; j < y1; ++j) {
+                    for (int i = x0; i < x1; ++i) {
+                        auto u = (i + random_double()) / image_width;
+                        auto v = (j + random_double()) / image_height;
+                        if (restir) {
+                            film.add_samples(i, j, restir->shade(i, j, [&](const ray& r, int depth, const vec3& normal, double pdf) {
+                                return ray_color(r, background, world, *sampler, depth, normal, pdf, cache.get(), guide.get());
+                            }));
+                            continue;
+                        }
+                        if (integrator == integrator_bdpt) {
+                            film.add_samples(i, j, bdpt.sample(u, v, splats));
+                            continue;
+                        }
+                        ray r = cam.get_ray(u, v, 1.0 / image_width, 1.0 / image_height);
+                        //color += ray_color(r, world, max_depth);
+                        film.add_samples(i, j, ray_color(r, background, world, *sampler, max_depth, vec3(0, 0, 0), 0, cache.get(), guide.get()));
+                    }
+                }
+
+                if (stream && ++finished_in_row[tile / film.tiles_per_row()] == film.tiles_per_row()) {
+                    for (int j = y0; j < y1; ++j) {
+                        film.write_row(j, row.data());
+                        stream->write_row(j, row.data());
+                    }
+                }
             }
-            color.write_color(i, j, image, samples_per_pixel);
+        };
+
+        unsigned int thread_count = std::max(1u, std::thread::hardware_concurrency());
+        std::vector<std::thread> workers;
+        for (unsigned int t = 0; t < thread_count; t++)
+            workers.emplace_back(render_tiles);
+        for (auto& worker : workers)
+            worker.join();
+        if (integrator == integrator_bdpt)
+            splats.flush_to(film);
+        if (guide)
+            guide->end_pass();
+    };
+
+    auto save_image = [&]() {
+        TGAImage image(image_width, image_height, TGAImage::RGB);
+        film.write_to(image);
+        image.write_tga_file("Image.tga");
+        //保留HDR数据，调整曝光时不需要重新渲染
+        film.write_exr_file("Image.exr");
+    };
+
+    bool streamed = false;
+    while (pass < samples_per_pixel) {
+        //最后一遍边渲染边写出Image.tga
+        TGAStreamWriter stream;
+        bool last = pass + 1 == samples_per_pixel;
+        //BDPT的splat和SPPM的估计要等整遍结束才能确定，不能边渲染边写出
+        streamed = last && integrator == integrator_path && stream.open("Image.tga", image_width, image_height, TGAImage::RGB);
+        render_pass(pass, streamed ? &stream : nullptr);
+        if (streamed)
+            streamed = stream.close();
+        pass++;
+        std::cerr << "\r已完成: " << pass << "/" << samples_per_pixel << " spp " << std::flush;
+        //定期输出快照和断点
+        if (pass % checkpoint_interval == 0 && pass < samples_per_pixel) {
+            save_image();
+            if (resumable)
+                film.write_checkpoint(checkpoint_file, pass, seed, settings);
         }
     }
-    image.write_tga_file("Image.tga");
+
+    if (streamed)
+        film.write_exr_file("Image.exr");
+    else
+        save_image();
+    if (resumable)
+        film.write_checkpoint(checkpoint_file, pass, seed, settings);
+    if (cache)
+        std::cerr << "\nRadiance cache: " << cache->used() << "/" << cache->capacity() << " entries";
     std::cerr << "\nDone.\n";
 }
\ No newline at end of file
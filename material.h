@@ -3,33 +3,54 @@
 
 #include "hittable.h"
 #include "texture.h"
+#include "onb.h"
+#include "microfacet.h"
+#include "distribution.h"
 
+//散射的结果
+struct scatter_record {
+    ray scattered;
+    //反照率
+    vec3 attenuation;
+    double pdf = 0;
+    //镜面反射/折射只有一个方向，没有pdf，也不对光源采样
+    bool is_specular = false;
+};
+
+//所有材质种类，material按type用switch分发，不用虚函数
+enum material_type { material_lambertian, material_metal, material_dielectric, material_diffuse_light };
+
+/*
+*材质是一个封闭的集合，每个子类在构造时写入自己的type。
+*基类的scatter/emitted/scattering_pdf根据type转换成具体的子类再调用，
+*子类的同名函数不是虚函数，编译器可以直接内联
+*/
 class material {
 public:
-    virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& albedo, ray& scattered, double& pdf) const
-    {
-        return false;
-    }
+    material_type type;
 
-    virtual vec3 emitted(const ray& r_in, const hit_record& rec, double u, double v, const vec3& p) const {
-        return vec3(0, 0, 0);
-    }
-
-    virtual double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const
-    {
-        return 0;
-    }
+    bool scatter(const ray& r_in, const hit_record& rec, scatter_record& srec) const;
+    vec3 emitted(const ray& r_in, const hit_record& rec, double u, double v, const vec3& p) const;
+    double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const;
+    //非镜面材质沿scattered方向的BSDF乘以cos，albedo为scatter得到的attenuation
+    vec3 eval(const ray& r_in, const hit_record& rec, const vec3& albedo, const ray& scattered) const;
+    //整个表面上自发光的平均值，光源采样按它估计功率
+    vec3 average_emission() const;
+    //自发光在uv上的分布，发光不随uv变化时返回nullptr
+    const distribution_2d* emission_distribution() const;
 
+protected:
+    explicit material(material_type t) : type(t) {}
 };
 
-//
+//漫反射材质
 class lambertian : public material {
 public:
-    lambertian(shared_ptr<texture> a) : albedo(a) {}
+    lambertian(shared_ptr<texture> a) : material(material_lambertian), albedo(a), albedo_program(*a) {}
 
-    virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& alb, ray& scattered, double& pdf) const override
+    bool scatter(const ray& r_in, const hit_record& rec, scatter_record& srec) const
     {
-        //䷽
+        //反射方向
         /*vec3 scatter_direction = rec.normal + random_unit_vector();
 
         if (scatter_direction.near_zero())
@@ -40,110 +61,401 @@ public:
         pdf = dot(rec.normal, scattered.direction()) / pi;
         return true;*/
 
-        auto direction = random_in_hemisphere(rec.normal);
-        scattered = ray(rec.p, unit_vector(direction), r_in.time());
-        alb = albedo->value(rec.u, rec.v, rec.p);
-        pdf = 0.5 / pi;
+        //按cos分布采样，和scattering_pdf一致，积分时两者相消
+        onb uvw(rec.normal);
+        auto direction = uvw.local(random_cosine_direction());
+        srec.scattered = ray(rec.p, unit_vector(direction), r_in.time());
+        srec.attenuation = albedo_program.value(rec.u, rec.v, rec.p, rec.uv_width);
+        srec.pdf = dot(uvw.w(), srec.scattered.direction()) / pi;
+        srec.is_specular = false;
         return true;
     }
 
-    double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const override
+    vec3 emitted(const ray& r_in, const hit_record& rec, double u, double v, const vec3& p) const {
+        return vec3(0, 0, 0);
+    }
+
+    double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const
     {
-        //ʲɢpdfs(direction)cos()
+        //朗伯曲面的散射pdf函数s(direction)正比于cos()
         auto cosine = dot(rec.normal, unit_vector(scattered.direction()));
-        //cosineֵɢߺͱ淨ߵļнǣԴ90Ч
+        //cosine值是散射光线和表面法线的夹角，所以大于90°无效
         return cosine < 0 ? 0 : cosine / pi;
     }
 
+    vec3 eval(const ray& r_in, const hit_record& rec, const vec3& alb, const ray& scattered) const
+    {
+        return alb * scattering_pdf(r_in, rec, scattered);
+    }
+
 public:
-    //
+    //反照率
     shared_ptr<texture> albedo;
+    //构造时从albedo展开，着色时只用这一份
+    texture_program albedo_program;
 };
 
-//
+//金属材质，fuzz为0时是理想镜面，否则是以fuzz为alpha的GGX导体
 class metal : public material {
 public:
-    metal(const vec3& a, double f) : albedo(a), fuzz(f < 1 ? f : 1) {}
+    metal(const vec3& a, double f) : material(material_metal), albedo(a), fuzz(f < 1 ? f : 1) {}
 
-    virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered) const
+    bool scatter(const ray& r_in, const hit_record& rec, scatter_record& srec) const
     {
-        vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-        //дֲڶʱ÷䷽һƫ
-        scattered = ray(rec.p, reflected + fuzz * random_in_unit_sphere());
-        attenuation = albedo;
-        return (dot(scattered.direction(), rec.normal) > 0);
+        srec.attenuation = albedo;
+        if (fuzz <= 0) {
+            srec.scattered = ray(rec.p, reflect(unit_vector(r_in.direction()), rec.normal), r_in.time());
+            srec.pdf = 0;
+            srec.is_specular = true;
+            return true;
+        }
+
+        //按可见法线采样微表面，再沿微表面法线反射
+        onb uvw(rec.normal);
+        vec3 wo = uvw.to_local(-unit_vector(r_in.direction()));
+        vec3 m = ggx_sample_vndf(wo, fuzz, random_double(), random_double());
+        vec3 wi = reflect(-wo, m);
+        //反射到表面以下的方向被遮挡，贡献为0
+        if (wi.z() <= 0)
+            return false;
+        srec.scattered = ray(rec.p, uvw.local(wi), r_in.time());
+        srec.pdf = ggx_vndf_pdf(wo, m, fuzz) / (4 * dot(wo, m));
+        srec.is_specular = false;
+        return srec.pdf > 0;
+    }
+
+    vec3 emitted(const ray& r_in, const hit_record& rec, double u, double v, const vec3& p) const {
+        return vec3(0, 0, 0);
+    }
+
+    double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const
+    {
+        vec3 wo, wi, m;
+        if (!half_vector(r_in, rec, scattered, wo, wi, m))
+            return 0;
+        return ggx_vndf_pdf(wo, m, fuzz) / (4 * dot(wo, m));
+    }
+
+    vec3 eval(const ray& r_in, const hit_record& rec, const vec3& alb, const ray& scattered) const
+    {
+        vec3 wo, wi, m;
+        if (!half_vector(r_in, rec, scattered, wo, wi, m))
+            return vec3(0, 0, 0);
+        //f * cos(wi) = F * D * G2 / (4 * cos(wo))
+        return fresnel_schlick(alb, dot(wo, m)) * (ggx_D(m, fuzz) * ggx_G2(wo, wi, fuzz) / (4 * wo.z()));
     }
 
 public:
-    //
+    //反照率
     vec3 albedo;
-    //ֲڶ
+    //粗糙度
     double fuzz;
+
+private:
+    //局部坐标系下的入射、出射方向和半程向量，两者不在法线同侧时返回false
+    bool half_vector(const ray& r_in, const hit_record& rec, const ray& scattered, vec3& wo, vec3& wi, vec3& m) const {
+        if (fuzz <= 0)
+            return false;
+        onb uvw(rec.normal);
+        wo = uvw.to_local(-unit_vector(r_in.direction()));
+        wi = uvw.to_local(unit_vector(scattered.direction()));
+        if (wo.z() <= 0 || wi.z() <= 0)
+            return false;
+        m = unit_vector(wo + wi);
+        return true;
+    }
 };
 
-//
+//折射材质，roughness为0时是光滑的玻璃，否则是以roughness为alpha的GGX粗糙电介质
 class dielectric : public material {
 public:
-    dielectric(double ri) : ref_idx(ri) {}
+    dielectric(double ri, double roughness = 0) : material(material_dielectric), ref_idx(ri), alpha(roughness) {}
 
-    virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered) const
+    bool scatter(const ray& r_in, const hit_record& rec, scatter_record& srec) const
     {
-        attenuation = vec3(1.0, 1.0, 1.0);
-        //ʵıֵ
+        srec.attenuation = vec3(1.0, 1.0, 1.0);
+        if (alpha > 0)
+            return scatter_rough(r_in, rec, srec);
+
+        srec.pdf = 0;
+        srec.is_specular = true;
+        //空气与其他介质的比值
         double etai_over_etat = (rec.front_face) ? (1.0 / ref_idx) : (ref_idx);
 
         vec3 unit_direction = unit_vector(r_in.direction());
 
         double cos_theta = ffmin(dot(-unit_direction, rec.normal), 1.0);
         double sin_theta = sqrt(1.0 - cos_theta * cos_theta);
-        //ʵ䣬
+        //如果从其他介质到空气，则发生反射，不发生折射
         if (etai_over_etat * sin_theta > 1.0) {
             vec3 reflected = reflect(unit_direction, rec.normal);
-            scattered = ray(rec.p, reflected);
+            srec.scattered = ray(rec.p, reflected, r_in.time());
             return true;
         }
 
-        //ʵеĲ, ĸʻǶı
+        //现实世界中的玻璃, 发生折射的概率会随着入射角而改变
         double reflect_prob = schlick(cos_theta, etai_over_etat);
         if (random_double() < reflect_prob)
         {
             vec3 reflected = reflect(unit_direction, rec.normal);
-            scattered = ray(rec.p, reflected);
+            srec.scattered = ray(rec.p, reflected, r_in.time());
             return true;
         }
 
-        //ֻ䣬Է
+        //这里只返回折射，忽略反射
         vec3 refracted = refract(unit_direction, rec.normal, etai_over_etat);
-        scattered = ray(rec.p, refracted);
+        srec.scattered = ray(rec.p, refracted, r_in.time());
         return true;
     }
+
+    vec3 emitted(const ray& r_in, const hit_record& rec, double u, double v, const vec3& p) const {
+        return vec3(0, 0, 0);
+    }
+
+    double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const
+    {
+        double pdf = 0;
+        if (alpha > 0)
+            evaluate(r_in, rec, scattered, pdf);
+        return pdf;
+    }
+
+    vec3 eval(const ray& r_in, const hit_record& rec, const vec3& alb, const ray& scattered) const
+    {
+        double pdf = 0;
+        if (alpha <= 0)
+            return vec3(0, 0, 0);
+        return alb * evaluate(r_in, rec, scattered, pdf);
+    }
+
 public:
     double ref_idx;
+    //粗糙度
+    double alpha;
+
+private:
+    //法线一侧（wo所在一侧）和另一侧的折射率
+    void indices(const hit_record& rec, double& eta_i, double& eta_t) const {
+        eta_i = rec.front_face ? 1.0 : ref_idx;
+        eta_t = rec.front_face ? ref_idx : 1.0;
+    }
+
+    //按可见法线采样微表面，按菲涅尔系数选择反射或折射
+    bool scatter_rough(const ray& r_in, const hit_record& rec, scatter_record& srec) const {
+        double eta_i, eta_t;
+        indices(rec, eta_i, eta_t);
+        onb uvw(rec.normal);
+        vec3 wo = uvw.to_local(-unit_vector(r_in.direction()));
+        vec3 m = ggx_sample_vndf(wo, alpha, random_double(), random_double());
+        double c = dot(wo, m);
+        double F = fresnel_dielectric(c, eta_i, eta_t);
+
+        vec3 wi;
+        if (random_double() < F) {
+            wi = reflect(-wo, m);
+            if (wi.z() <= 0)
+                return false;
+        }
+        else {
+            double eta = eta_i / eta_t;
+            double k = 1 - eta * eta * (1 - c * c);
+            wi = -eta * wo + (eta * c - sqrt(ffmax(k, 0.0))) * m;
+            if (wi.z() >= 0)
+                return false;
+        }
+        srec.scattered = ray(rec.p, uvw.local(wi), r_in.time());
+        srec.is_specular = false;
+        evaluate(r_in, rec, srec.scattered, srec.pdf);
+        return srec.pdf > 0;
+    }
+
+    //返回f * |cos(wi)|，同时算出采样到scattered的pdf
+    double evaluate(const ray& r_in, const hit_record& rec, const ray& scattered, double& pdf) const {
+        pdf = 0;
+        double eta_i, eta_t;
+        indices(rec, eta_i, eta_t);
+        onb uvw(rec.normal);
+        vec3 wo = uvw.to_local(-unit_vector(r_in.direction()));
+        vec3 wi = uvw.to_local(unit_vector(scattered.direction()));
+        if (wo.z() <= 0 || wi.z() == 0)
+            return 0;
+
+        if (wi.z() > 0) {
+            //反射
+            vec3 m = unit_vector(wo + wi);
+            double F = fresnel_dielectric(dot(wo, m), eta_i, eta_t);
+            pdf = F * ggx_vndf_pdf(wo, m, alpha) / (4 * dot(wo, m));
+            return F * ggx_D(m, alpha) * ggx_G2(wo, wi, alpha) / (4 * wo.z());
+        }
+
+        //折射，半程向量朝向法线一侧
+        vec3 m = unit_vector(eta_i * wo + eta_t * wi);
+        if (m.z() < 0)
+            m = -m;
+        double cos_o = dot(wo, m), cos_i = dot(wi, m);
+        if (cos_o <= 0 || cos_i >= 0)
+            return 0;
+        double F = fresnel_dielectric(cos_o, eta_i, eta_t);
+        double denom = eta_i * cos_o + eta_t * cos_i;
+        //从微表面法线到折射方向的雅可比
+        double jacobian = eta_t * eta_t * -cos_i / (denom * denom);
+        pdf = (1 - F) * ggx_vndf_pdf(wo, m, alpha) * jacobian;
+        //辐亮度不按折射率缩放，和光滑玻璃保持一致，alpha趋于0时结果也趋于光滑玻璃
+        return (1 - F) * ggx_D(m, alpha) * ggx_G2(wo, wi, alpha) * cos_o * jacobian / wo.z();
+    }
 };
 
-//
+//自身发光材质
 class diffuse_light : public material {
 public:
-    diffuse_light(shared_ptr<texture> a) : emit(a) {}
+    diffuse_light(shared_ptr<texture> a) : material(material_diffuse_light), emit(a), emit_program(*a) {
+        build_distribution();
+    }
 
-    virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered) const
+    bool scatter(const ray& r_in, const hit_record& rec, scatter_record& srec) const
     {
         return false;
     }
 
-    virtual vec3 emitted(const ray& r_in, const hit_record& rec, double u, double v, const vec3& p) const override
-    {    
-        //Դͬ򷵻عԴɫ
+    vec3 emitted(const ray& r_in, const hit_record& rec, double u, double v, const vec3& p) const
+    {
+        //入射光线与光源法向量朝向不同，则返回光源颜色
         if (rec.front_face)
-            return emit->value(u, v, p);
+            return emit_program.value(u, v, p);
         else
             return vec3(0, 0, 0);
     }
 
+    double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const
+    {
+        return 0;
+    }
+
+    vec3 eval(const ray& r_in, const hit_record& rec, const vec3& albedo, const ray& scattered) const
+    {
+        return vec3(0, 0, 0);
+    }
+
+    //在uv上取16x16个点求平均，只和位置有关的纹理按原点处的值估计
+    vec3 average_emission() const
+    {
+        const int n = 16;
+        vec3 sum(0, 0, 0);
+        for (int j = 0; j < n; j++)
+            for (int i = 0; i < n; i++)
+                sum += emit_program.value((i + 0.5) / n, (j + 0.5) / n, vec3(0, 0, 0));
+        return sum / (n * n);
+    }
+
 public:
     shared_ptr<texture> emit;
+    texture_program emit_program;
+    //按亮度在uv上的分布，光源采样时亮的区域采得更多
+    distribution_2d emit_distribution;
+
+private:
+    //只给贴图这类只和uv有关的发光建表，棋盘格、噪声和位置有关，uv上的分布不能代表它们
+    void build_distribution() {
+        if (emit_program.nodes.empty() || emit_program.nodes[0].op != texture_program::op_texture)
+            return;
+        const int nu = 256, nv = 128;
+        std::vector<double> f(size_t(nu) * nv);
+        double sum = 0;
+        for (int j = 0; j < nv; j++) {
+            for (int i = 0; i < nu; i++) {
+                vec3 c = emit_program.value((i + 0.5) / nu, (j + 0.5) / nv, vec3(0, 0, 0), 1.0 / nu);
+                f[size_t(j) * nu + i] = luminance(c);
+                sum += f[size_t(j) * nu + i];
+            }
+        }
+        if (sum <= 0)
+            return;
+        //格子中心之间可能有比中心更亮的像素，给每格留一点概率，保证发光的地方都能采到
+        double floor_value = 0.01 * sum / f.size();
+        for (double& x : f)
+            x += floor_value;
+        emit_distribution = distribution_2d(f, nu, nv);
+    }
 };
 
+//按type分发到具体材质
+inline bool material::scatter(const ray& r_in, const hit_record& rec, scatter_record& srec) const {
+    switch (type) {
+    case material_lambertian:
+        return static_cast<const lambertian*>(this)->scatter(r_in, rec, srec);
+    case material_metal:
+        return static_cast<const metal*>(this)->scatter(r_in, rec, srec);
+    case material_dielectric:
+        return static_cast<const dielectric*>(this)->scatter(r_in, rec, srec);
+    default:
+        return static_cast<const diffuse_light*>(this)->scatter(r_in, rec, srec);
+    }
+}
+
+inline vec3 material::emitted(const ray& r_in, const hit_record& rec, double u, double v, const vec3& p) const {
+    //只有光源会发光
+    if (type != material_diffuse_light)
+        return vec3(0, 0, 0);
+    return static_cast<const diffuse_light*>(this)->emitted(r_in, rec, u, v, p);
+}
+
+inline double material::scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const {
+    switch (type) {
+    case material_lambertian:
+        return static_cast<const lambertian*>(this)->scattering_pdf(r_in, rec, scattered);
+    case material_metal:
+        return static_cast<const metal*>(this)->scattering_pdf(r_in, rec, scattered);
+    case material_dielectric:
+        return static_cast<const dielectric*>(this)->scattering_pdf(r_in, rec, scattered);
+    default:
+        return static_cast<const diffuse_light*>(this)->scattering_pdf(r_in, rec, scattered);
+    }
+}
+
+inline vec3 material::eval(const ray& r_in, const hit_record& rec, const vec3& albedo, const ray& scattered) const {
+    switch (type) {
+    case material_lambertian:
+        return static_cast<const lambertian*>(this)->eval(r_in, rec, albedo, scattered);
+    case material_metal:
+        return static_cast<const metal*>(this)->eval(r_in, rec, albedo, scattered);
+    case material_dielectric:
+        return static_cast<const dielectric*>(this)->eval(r_in, rec, albedo, scattered);
+    default:
+        return static_cast<const diffuse_light*>(this)->eval(r_in, rec, albedo, scattered);
+    }
+}
+
+inline vec3 material::average_emission() const {
+    if (type != material_diffuse_light)
+        return vec3(0, 0, 0);
+    return static_cast<const diffuse_light*>(this)->average_emission();
+}
+
+inline const distribution_2d* material::emission_distribution() const {
+    if (type != material_diffuse_light)
+        return nullptr;
+    const distribution_2d& d = static_cast<const diffuse_light*>(this)->emit_distribution;
+    return d.empty() ? nullptr : &d;
+}
+
+//在发光材质的uv分布上采样(u,v)，返回相对uv面积的pdf，没有分布时均匀采样
+inline double sample_emission_uv(const material* m, double& u, double& v) {
+    const distribution_2d* d = m ? m->emission_distribution() : nullptr;
+    if (!d) {
+        u = random_double();
+        v = random_double();
+        return 1;
+    }
+    double pdf;
+    d->sample(random_double(), random_double(), u, v, pdf);
+    return pdf;
+}
+
+inline double emission_uv_pdf(const material* m, double u, double v) {
+    const distribution_2d* d = m ? m->emission_distribution() : nullptr;
+    return d ? d->pdf(u, v) : 1;
+}
+
 #endif // !Material
 
 
@@ -0,0 +1,82 @@
+#ifndef Microfacet_H
+#define Microfacet_H
+
+#include "rtweekend.h"
+
+/*
+*各向同性GGX(Trowbridge-Reitz)微表面模型。
+*所有方向都在以宏观法线为z轴的局部坐标系下，alpha为粗糙度
+*/
+
+//法线分布D(m)
+inline double ggx_D(const vec3& m, double alpha) {
+    if (m.z() <= 0)
+        return 0;
+    double a2 = alpha * alpha;
+    double t = m.z() * m.z() * (a2 - 1) + 1;
+    return a2 / (pi * t * t);
+}
+
+//Smith遮蔽函数里的Lambda
+inline double ggx_lambda(const vec3& w, double alpha) {
+    double z2 = w.z() * w.z();
+    if (z2 <= 0)
+        return infinity;
+    double tan2 = ffmax(1 - z2, 0.0) / z2;
+    return (-1 + sqrt(1 + alpha * alpha * tan2)) / 2;
+}
+
+inline double ggx_G1(const vec3& w, double alpha) {
+    return 1 / (1 + ggx_lambda(w, alpha));
+}
+
+//高度相关的遮蔽-阴影函数
+inline double ggx_G2(const vec3& wo, const vec3& wi, double alpha) {
+    return 1 / (1 + ggx_lambda(wo, alpha) + ggx_lambda(wi, alpha));
+}
+
+//从wo看过去可见的微表面法线的pdf
+inline double ggx_vndf_pdf(const vec3& wo, const vec3& m, double alpha) {
+    double c = dot(wo, m);
+    if (c <= 0 || wo.z() <= 0)
+        return 0;
+    return ggx_G1(wo, alpha) * c * ggx_D(m, alpha) / wo.z();
+}
+
+//按可见法线分布采样微表面法线(Heitz 2018)，不会采到背对wo的法线
+inline vec3 ggx_sample_vndf(const vec3& wo, double alpha, double u1, double u2) {
+    //拉伸到alpha=1的半球上
+    vec3 vh = unit_vector(vec3(alpha * wo.x(), alpha * wo.y(), wo.z()));
+    double lensq = vh.x() * vh.x() + vh.y() * vh.y();
+    vec3 t1 = lensq > 0 ? vec3(-vh.y(), vh.x(), 0) / sqrt(lensq) : vec3(1, 0, 0);
+    vec3 t2 = cross(vh, t1);
+    //在投影的圆盘上均匀采样，再按可见比例压缩下半部分
+    double r = sqrt(u1);
+    double phi = 2 * pi * u2;
+    double p1 = r * cos(phi);
+    double p2 = r * sin(phi);
+    double s = 0.5 * (1 + vh.z());
+    p2 = (1 - s) * sqrt(1 - p1 * p1) + s * p2;
+    vec3 nh = p1 * t1 + p2 * t2 + sqrt(ffmax(0.0, 1 - p1 * p1 - p2 * p2)) * vh;
+    //变换回椭球
+    return unit_vector(vec3(alpha * nh.x(), alpha * nh.y(), ffmax(0.0, nh.z())));
+}
+
+//电介质的菲涅尔反射率，全反射时返回1
+inline double fresnel_dielectric(double cos_i, double eta_i, double eta_t) {
+    cos_i = clamp(cos_i, 0.0, 1.0);
+    double sin_t = eta_i / eta_t * sqrt(ffmax(0.0, 1 - cos_i * cos_i));
+    if (sin_t >= 1)
+        return 1;
+    double cos_t = sqrt(ffmax(0.0, 1 - sin_t * sin_t));
+    double rs = (eta_i * cos_i - eta_t * cos_t) / (eta_i * cos_i + eta_t * cos_t);
+    double rp = (eta_t * cos_i - eta_i * cos_t) / (eta_t * cos_i + eta_i * cos_t);
+    return (rs * rs + rp * rp) / 2;
+}
+
+//导体用Schlick近似，f0为正对时的反射颜色
+inline vec3 fresnel_schlick(const vec3& f0, double cos_i) {
+    return f0 + (vec3(1, 1, 1) - f0) * pow(1 - clamp(cos_i, 0.0, 1.0), 5);
+}
+
+#endif // !Microfacet_H
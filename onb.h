@@ -0,0 +1,45 @@
+#ifndef ONB_H
+#define ONB_H
+
+#include "rtweekend.h"
+
+//以w为法线的正交基，用来把局部坐标系下采样的方向转到世界坐标
+class onb {
+public:
+    onb() {}
+    explicit onb(const vec3& n) { build_from_w(n); }
+
+    vec3 operator[](int i) const { return axis[i]; }
+
+    vec3 u() const { return axis[0]; }
+    vec3 v() const { return axis[1]; }
+    vec3 w() const { return axis[2]; }
+
+    vec3 local(double a, double b, double c) const {
+        return a * u() + b * v() + c * w();
+    }
+
+    vec3 local(const vec3& a) const {
+        return a.x() * u() + a.y() * v() + a.z() * w();
+    }
+
+    //世界坐标转到这个局部坐标系
+    vec3 to_local(const vec3& a) const {
+        return vec3(dot(a, u()), dot(a, v()), dot(a, w()));
+    }
+
+    //n必须是单位向量。Duff等人的无分支构造方法，不需要挑一个不平行的辅助轴
+    void build_from_w(const vec3& n) {
+        double sign = copysign(1.0, n.z());
+        double a = -1.0 / (sign + n.z());
+        double b = n.x() * n.y() * a;
+        axis[0] = vec3(1.0 + sign * n.x() * n.x() * a, sign * b, -sign * n.x());
+        axis[1] = vec3(b, sign + n.y() * n.y() * a, -n.y());
+        axis[2] = n;
+    }
+
+public:
+    vec3 axis[3];
+};
+
+#endif // !ONB_H
@@ -0,0 +1,375 @@
+#ifndef PathGuide_H
+#define PathGuide_H
+
+#include <atomic>
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <vector>
+#include "vec3.h"
+#include "boundingBox.h"
+
+/*
+*方向四叉树：方向按圆柱坐标(cos theta, phi)映射到单位正方形上（保持面积），
+*每个节点记录四个子格子里累加的入射辐亮度，按能量比例往下走就能采样，
+*能量集中的地方格子细、其余的地方格子粗
+*/
+class guide_dtree {
+public:
+    struct node {
+        std::atomic<float> sum[4];
+        //子节点编号，0表示该格子是叶子
+        int child[4];
+
+        node() {
+            for (int c = 0; c < 4; c++) {
+                sum[c].store(0, std::memory_order_relaxed);
+                child[c] = 0;
+            }
+        }
+        node(const node& o) { *this = o; }
+        node& operator=(const node& o) {
+            for (int c = 0; c < 4; c++) {
+                sum[c].store(o.sum[c].load(std::memory_order_relaxed), std::memory_order_relaxed);
+                child[c] = o.child[c];
+            }
+            return *this;
+        }
+        double total() const {
+            return double(sum[0].load(std::memory_order_relaxed)) + sum[1].load(std::memory_order_relaxed)
+                + sum[2].load(std::memory_order_relaxed) + sum[3].load(std::memory_order_relaxed);
+        }
+    };
+
+    guide_dtree() : nodes(1) {}
+
+    size_t node_count() const { return nodes.size(); }
+    double total() const { return nodes[0].total(); }
+
+    //把(x,y)处的一个样本累加到从根到叶子的每个节点上
+    void record(double x, double y, float value) {
+        int n = 0;
+        for (;;) {
+            int c = quadrant(x, y);
+            float old = nodes[n].sum[c].load(std::memory_order_relaxed);
+            while (!nodes[n].sum[c].compare_exchange_weak(old, old + value, std::memory_order_relaxed)) {}
+            if (nodes[n].child[c] == 0)
+                return;
+            n = nodes[n].child[c];
+        }
+    }
+
+    //返回相对正方形面积的pdf。先按左右两半的能量选一边，再在这一边按上下选，随机数缩放后继续使用
+    double sample(double u1, double u2, double& x, double& y) const {
+        int n = 0;
+        double x0 = 0, y0 = 0, size = 1, pdf = 1;
+        for (;;) {
+            const node& nd = nodes[n];
+            double s[4];
+            for (int c = 0; c < 4; c++)
+                s[c] = nd.sum[c].load(std::memory_order_relaxed);
+            double t = s[0] + s[1] + s[2] + s[3];
+            int c = 0;
+            if (t <= 0) {
+                //没有能量的节点均匀采样
+                c = (u1 < 0.5 ? 0 : 1) + (u2 < 0.5 ? 0 : 2);
+                u1 = u1 < 0.5 ? 2 * u1 : 2 * u1 - 1;
+                u2 = u2 < 0.5 ? 2 * u2 : 2 * u2 - 1;
+            }
+            else {
+                double left = (s[0] + s[2]) / t;
+                int xbit = u1 < left ? 0 : 1;
+                u1 = xbit == 0 ? u1 / left : (u1 - left) / (1 - left);
+                double column = s[xbit] + s[xbit + 2];
+                double bottom = s[xbit] / column;
+                int ybit = u2 < bottom ? 0 : 1;
+                u2 = ybit == 0 ? u2 / bottom : (u2 - bottom) / (1 - bottom);
+                c = xbit + 2 * ybit;
+                pdf *= 4 * s[c] / t;
+            }
+            u1 = ffmin(u1, 0.99999999999999989);
+            u2 = ffmin(u2, 0.99999999999999989);
+            size *= 0.5;
+            x0 += (c & 1) * size;
+            y0 += (c >> 1) * size;
+            if (nd.child[c] == 0)
+                break;
+            n = nd.child[c];
+        }
+        x = x0 + u1 * size;
+        y = y0 + u2 * size;
+        return pdf;
+    }
+
+    double pdf(double x, double y) const {
+        int n = 0;
+        double pdf = 1;
+        for (;;) {
+            const node& nd = nodes[n];
+            int c = quadrant(x, y);
+            double t = nd.total();
+            if (t > 0)
+                pdf *= 4 * nd.sum[c].load(std::memory_order_relaxed) / t;
+            if (pdf == 0 || nd.child[c] == 0)
+                return pdf;
+            n = nd.child[c];
+        }
+    }
+
+    /*
+    *按这次记录的能量重新划分：占总能量比例超过threshold的格子细分，低于的合并。
+    *返回的新树能量全部清零，用于下一轮记录
+    */
+    guide_dtree refined(double threshold, int max_depth) const {
+        guide_dtree result;
+        double t = total();
+        if (t <= 0) {
+            result.nodes = nodes;
+            result.clear();
+            return result;
+        }
+        //energy是该节点所占格子的能量，旧树在这里已经是叶子时按平均分给四个子格子估计
+        struct item { int old_node; int new_node; int depth; double energy; };
+        std::vector<item> stack;
+        stack.push_back({ 0, 0, 1, t });
+        while (!stack.empty()) {
+            item it = stack.back();
+            stack.pop_back();
+            for (int c = 0; c < 4; c++) {
+                double e = it.old_node >= 0 ? nodes[it.old_node].sum[c].load(std::memory_order_relaxed) : it.energy / 4;
+                if (e / t <= threshold || it.depth >= max_depth)
+                    continue;
+                int child = static_cast<int>(result.nodes.size());
+                result.nodes.emplace_back();
+                result.nodes[it.new_node].child[c] = child;
+                int old_child = it.old_node >= 0 ? nodes[it.old_node].child[c] : 0;
+                stack.push_back({ old_child != 0 ? old_child : -1, child, it.depth + 1, e });
+            }
+        }
+        return result;
+    }
+
+    void clear() {
+        for (auto& n : nodes)
+            for (auto& s : n.sum)
+                s.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    std::vector<node> nodes;
+
+    //取出(x,y)所在的子格子，并把坐标换算到子格子内
+    static int quadrant(double& x, double& y) {
+        int xbit = x < 0.5 ? 0 : 1, ybit = y < 0.5 ? 0 : 2;
+        x = xbit ? 2 * x - 1 : 2 * x;
+        y = ybit ? 2 * y - 1 : 2 * y;
+        return xbit + ybit;
+    }
+};
+
+/*
+*路径引导（SD-tree）：空间上用二叉树按轴交替划分场景包围盒，每个叶子按法线的主轴和正负分成6组，
+*每组一棵方向四叉树，避免同一个叶子里朝向不同的表面（比如薄板的两面）互相干扰。
+*训练分轮进行，第k轮持续2^k遍：渲染时按上一轮学到的分布采样，同时把这一轮的样本记到新树里；
+*每轮结束时样本多的空间叶子一分为二，方向树按能量重新细分，再交换两棵树。
+*引导只用于朗伯面，按fraction的概率采样学到的分布、其余按材质采样，pdf取两者的混合。
+*节点总内存超过memory_limit后不再细分
+*/
+class path_guide {
+public:
+    path_guide(const aabb& bounds, int training_passes, size_t memory_limit = size_t(32) << 20)
+        : training_passes(training_passes), memory_limit(memory_limit) {
+        snodes.push_back(spatial_node());
+        snodes[0].leaf = 0;
+        leaves.emplace_back(new guide_leaf());
+        leaves[0]->box = bounds;
+    }
+
+    bool training() const { return passes < training_passes; }
+
+    //法线为n的p点学到的分布，没有数据时返回nullptr
+    const guide_dtree* sampling_tree(const vec3& p, const vec3& n) const {
+        const guide_dtree& tree = leaves[find(p)]->sampling[bucket(n)];
+        return tree.total() > 0 ? &tree : nullptr;
+    }
+
+    //在p点记录从dir方向入射的辐亮度估计（已除以采样pdf）
+    void record(const vec3& p, const vec3& n, const vec3& dir, double value) {
+        if (!(value > 0) || !std::isfinite(value))
+            return;
+        guide_leaf& leaf = *leaves[find(p)];
+        double x, y;
+        direction_to_square(dir, x, y);
+        leaf.building[bucket(n)].record(x, y, static_cast<float>(value));
+        leaf.count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static vec3 sample(const guide_dtree& tree, double u1, double u2) {
+        double x, y;
+        tree.sample(u1, u2, x, y);
+        return square_to_direction(x, y);
+    }
+
+    //立体角上的pdf
+    static double pdf(const guide_dtree& tree, const vec3& dir) {
+        double x, y;
+        direction_to_square(dir, x, y);
+        return tree.pdf(x, y) / (4 * pi);
+    }
+
+    //每渲染完一遍调用，一轮结束时更新分布
+    void end_pass() {
+        if (!training())
+            return;
+        passes++;
+        passes_in_iteration++;
+        if (passes_in_iteration < (1 << iteration) && passes < training_passes)
+            return;
+        update();
+        passes_in_iteration = 0;
+        iteration++;
+    }
+
+    size_t memory_used() const {
+        size_t nodes = 0;
+        for (const auto& leaf : leaves)
+            for (int b = 0; b < normal_buckets; b++)
+                nodes += leaf->sampling[b].node_count() + leaf->building[b].node_count();
+        return nodes * sizeof(guide_dtree::node) + snodes.size() * sizeof(spatial_node) + leaves.size() * sizeof(guide_leaf);
+    }
+
+public:
+    //按学到的分布采样的概率
+    double fraction = 0.5;
+    //空间叶子的样本数超过spatial_threshold*sqrt(2^k)时细分
+    double spatial_threshold = 12000;
+    //方向格子的能量占比超过directional_threshold时细分
+    double directional_threshold = 0.01;
+    int max_directional_depth = 20;
+
+private:
+    struct spatial_node {
+        int axis = 0;
+        double split = 0;
+        int child[2] = { 0, 0 };
+        //叶子的编号，内部节点为-1
+        int leaf = -1;
+    };
+
+    static const int normal_buckets = 6;
+
+    struct guide_leaf {
+        aabb box;
+        guide_dtree sampling[normal_buckets];
+        guide_dtree building[normal_buckets];
+        std::atomic<int> count;
+        guide_leaf() : count(0) {}
+    };
+
+    int training_passes;
+    size_t memory_limit;
+    int passes = 0;
+    int passes_in_iteration = 0;
+    int iteration = 0;
+    std::vector<spatial_node> snodes;
+    std::vector<std::unique_ptr<guide_leaf>> leaves;
+
+    static void direction_to_square(const vec3& dir, double& x, double& y) {
+        vec3 d = unit_vector(dir);
+        x = clamp((d.z() + 1) * 0.5, 0.0, 0.99999999999999989);
+        double phi = atan2(d.y(), d.x());
+        if (phi < 0)
+            phi += 2 * pi;
+        y = clamp(phi / (2 * pi), 0.0, 0.99999999999999989);
+    }
+
+    static vec3 square_to_direction(double x, double y) {
+        double cos_theta = 2 * x - 1;
+        double sin_theta = sqrt(ffmax(0.0, 1 - cos_theta * cos_theta));
+        double phi = 2 * pi * y;
+        return vec3(sin_theta * cos(phi), sin_theta * sin(phi), cos_theta);
+    }
+
+    static int bucket(const vec3& n) {
+        int axis = 0;
+        for (int a = 1; a < 3; a++)
+            if (fabs(n[a]) > fabs(n[axis]))
+                axis = a;
+        return axis * 2 + (n[axis] < 0);
+    }
+
+    int find(const vec3& p) const {
+        int n = 0;
+        while (snodes[n].leaf < 0)
+            n = p[snodes[n].axis] < snodes[n].split ? snodes[n].child[0] : snodes[n].child[1];
+        return snodes[n].leaf;
+    }
+
+    void update() {
+        double threshold = spatial_threshold * sqrt(double(1 << iteration));
+        size_t recorded = 0;
+        for (const auto& leaf : leaves)
+            recorded += leaf->count.load();
+        //空间细分：叶子沿当前的轴从中间分开，两边先复制同一棵记录树。
+        //新加的节点排在后面，同一次更新里还会继续检查
+        for (size_t n = 0; n < snodes.size(); n++) {
+            if (snodes[n].leaf < 0 || leaves[snodes[n].leaf]->count.load() <= threshold || memory_used() > memory_limit)
+                continue;
+            split(static_cast<int>(n));
+        }
+
+        //方向树：记录树变成采样树，再按能量细分出下一轮的记录树
+        size_t directional_nodes = 0;
+        bool refine = memory_used() < memory_limit;
+        for (auto& leaf : leaves) {
+            for (int b = 0; b < normal_buckets; b++) {
+                leaf->sampling[b] = leaf->building[b];
+                if (refine)
+                    leaf->building[b] = leaf->sampling[b].refined(directional_threshold, max_directional_depth);
+                else
+                    leaf->building[b].clear();
+                directional_nodes += leaf->sampling[b].node_count();
+            }
+            leaf->count = 0;
+        }
+        std::cerr << "\nPath guiding iteration " << iteration << ": " << recorded << " samples, "
+            << leaves.size() << " spatial leaves, " << directional_nodes << " directional nodes, "
+            << memory_used() / 1024 << " KB\n";
+    }
+
+    //叶子分成两半，样本数各记一半
+    void split(int n) {
+        int left_leaf = snodes[n].leaf;
+        int axis = snodes[n].axis;
+        guide_leaf& left = *leaves[left_leaf];
+        double mid = 0.5 * (left.box.min()[axis] + left.box.max()[axis]);
+        vec3 left_max = left.box.max(), right_min = left.box.min();
+        left_max[axis] = mid;
+        right_min[axis] = mid;
+
+        leaves.emplace_back(new guide_leaf());
+        guide_leaf& right = *leaves.back();
+        right.box = aabb(right_min, left.box.max());
+        left.box = aabb(left.box.min(), left_max);
+        for (int b = 0; b < normal_buckets; b++) {
+            right.sampling[b] = left.sampling[b];
+            right.building[b] = left.building[b];
+        }
+        int half = left.count.load() / 2;
+        left.count = half;
+        right.count = half;
+
+        int child = static_cast<int>(snodes.size());
+        snodes.resize(snodes.size() + 2);
+        for (int k = 0; k < 2; k++)
+            snodes[child + k].axis = (axis + 1) % 3;
+        snodes[child].leaf = left_leaf;
+        snodes[child + 1].leaf = static_cast<int>(leaves.size()) - 1;
+        snodes[n].leaf = -1;
+        snodes[n].split = mid;
+        snodes[n].child[0] = child;
+        snodes[n].child[1] = child + 1;
+    }
+};
+
+#endif // !PathGuide_H
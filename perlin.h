@@ -3,80 +3,191 @@
 
 #include "vec3.h"
 
-inline double trilinear_interp(double c[2][2][2], double u, double v, double w) {
-    auto accum = 0.0;
-    for (int i = 0; i < 2; i++)
-        for (int j = 0; j < 2; j++)
-            for (int k = 0; k < 2; k++)
-                accum += (i * u + (1 - i) * (1 - u)) *
-                (j * v + (1 - j) * (1 - v)) *
-                (k * w + (1 - k) * (1 - w)) * c[i][j][k];
-
-    return accum;
-}
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PERLIN_SSE2 1
+#endif
+
+//Improved Perlin noise的16个梯度方向（立方体12条棱的中点，补4个凑成16个）
+static const float perlin_gradients[16][3] = {
+    { 1, 1, 0 }, { -1, 1, 0 }, { 1, -1, 0 }, { -1, -1, 0 },
+    { 1, 0, 1 }, { -1, 0, 1 }, { 1, 0, -1 }, { -1, 0, -1 },
+    { 0, 1, 1 }, { 0, -1, 1 }, { 0, 1, -1 }, { 0, -1, -1 },
+    { 1, 1, 0 }, { 0, -1, 1 }, { -1, 1, 0 }, { 0, -1, -1 }
+};
+
+//噪声贴图的几种用法
+enum noise_type { noise_plain, noise_fbm, noise_turbulence, noise_marble };
 
 class perlin {
 public:
     perlin() {
-        ranfloat = new double[point_count];
-        for (int i = 0; i < point_count; ++i) {
-            ranfloat[i] = random_double();
-        }
-
-        perm_x = perlin_generate_perm();
-        perm_y = perlin_generate_perm();
-        perm_z = perlin_generate_perm();
+        for (int i = 0; i < point_count; i++)
+            perm[i] = i;
+        permute(perm, point_count);
+        //复制一份接在后面，查表时不用再对第二次索引取模
+        for (int i = 0; i < point_count; i++)
+            perm[point_count + i] = perm[i];
     }
 
-    ~perlin() {
-        delete[] ranfloat;
-        delete[] perm_x;
-        delete[] perm_y;
-        delete[] perm_z;
+    //梯度噪声，返回值在[-1,1]
+    double noise(const vec3& p) const {
+        double fx = floor(p.x()), fy = floor(p.y()), fz = floor(p.z());
+        double x = p.x() - fx, y = p.y() - fy, z = p.z() - fz;
+        int h[8];
+        corner_hashes(static_cast<int>(fx), static_cast<int>(fy), static_cast<int>(fz), h);
+
+        double u = fade(x), v = fade(y), w = fade(z);
+        double x00 = lerp(u, grad(h[0], x, y, z), grad(h[1], x - 1, y, z));
+        double x10 = lerp(u, grad(h[2], x, y - 1, z), grad(h[3], x - 1, y - 1, z));
+        double x01 = lerp(u, grad(h[4], x, y, z - 1), grad(h[5], x - 1, y, z - 1));
+        double x11 = lerp(u, grad(h[6], x, y - 1, z - 1), grad(h[7], x - 1, y - 1, z - 1));
+        return lerp(w, lerp(v, x00, x10), lerp(v, x01, x11));
     }
 
-    //Բֵֵ
-    double noise(const vec3& p) const {
-        auto u = p.x() - floor(p.x());
-        auto v = p.y() - floor(p.y());
-        auto w = p.z() - floor(p.z());
+    //一次求4个点的噪声，fBm和湍流用它同时算4个八度
+    void noise4(const float* px, const float* py, const float* pz, float* out) const {
+#if PERLIN_SSE2
+        __m128 x = _mm_loadu_ps(px), y = _mm_loadu_ps(py), z = _mm_loadu_ps(pz);
+        __m128i ix = floor4(x), iy = floor4(y), iz = floor4(z);
+        x = _mm_sub_ps(x, _mm_cvtepi32_ps(ix));
+        y = _mm_sub_ps(y, _mm_cvtepi32_ps(iy));
+        z = _mm_sub_ps(z, _mm_cvtepi32_ps(iz));
+
+        alignas(16) int cx[4], cy[4], cz[4];
+        _mm_store_si128(reinterpret_cast<__m128i*>(cx), ix);
+        _mm_store_si128(reinterpret_cast<__m128i*>(cy), iy);
+        _mm_store_si128(reinterpret_cast<__m128i*>(cz), iz);
+
+        //哈希只能逐个查表，之后8个角点的梯度点积都用SIMD算
+        alignas(16) int h[8][4];
+        for (int k = 0; k < 4; k++) {
+            int hk[8];
+            corner_hashes(cx[k], cy[k], cz[k], hk);
+            for (int c = 0; c < 8; c++)
+                h[c][k] = hk[c];
+        }
 
-        int i = floor(p.x());
-            int j = floor(p.y());
-            int k = floor(p.z());
-            double c[2][2][2];
+        const __m128 one = _mm_set1_ps(1);
+        __m128 x1 = _mm_sub_ps(x, one), y1 = _mm_sub_ps(y, one), z1 = _mm_sub_ps(z, one);
+        __m128 d[8];
+        for (int c = 0; c < 8; c++)
+            d[c] = grad4(_mm_load_si128(reinterpret_cast<const __m128i*>(h[c])), (c & 1) ? x1 : x, (c & 2) ? y1 : y, (c & 4) ? z1 : z);
+
+        __m128 u = fade4(x), v = fade4(y), w = fade4(z);
+        __m128 x00 = lerp4(u, d[0], d[1]);
+        __m128 x10 = lerp4(u, d[2], d[3]);
+        __m128 x01 = lerp4(u, d[4], d[5]);
+        __m128 x11 = lerp4(u, d[6], d[7]);
+        _mm_storeu_ps(out, lerp4(w, lerp4(v, x00, x10), lerp4(v, x01, x11)));
+#else
+        for (int k = 0; k < 4; k++)
+            out[k] = static_cast<float>(noise(vec3(px[k], py[k], pz[k])));
+#endif
+    }
 
-            for (int di=0; di < 2; di++)
-                for (int dj=0; dj < 2; dj++)
-                    for (int dk=0; dk < 2; dk++)
-                        c[di][dj][dk] = ranfloat[
-                            perm_x[(i+di) & 255] ^
-                            perm_y[(j+dj) & 255] ^
-                            perm_z[(k+dk) & 255]
-                        ];
+    //分形布朗运动，每个八度频率加倍、振幅减半，返回值大致在[-1,1]
+    double fbm(const vec3& p, int octaves = 7) const {
+        return sum_octaves(p, octaves, false);
+    }
 
-            return trilinear_interp(c, u, v, w);
+    //湍流，对每个八度的绝对值求和
+    double turb(const vec3& p, int depth = 7) const {
+        return sum_octaves(p, depth, true);
     }
 
 private:
     static const int point_count = 256;
-    //
-    double* ranfloat;
-    int* perm_x;
-    int* perm_y;
-    int* perm_z;
+    //单张置换表，长度为两倍
+    int perm[2 * point_count];
+
+    static double fade(double t) {
+        return t * t * t * (t * (t * 6 - 15) + 10);
+    }
+
+    static double lerp(double t, double a, double b) {
+        return a + t * (b - a);
+    }
 
-    //һ飬ֵֵ
-    static int* perlin_generate_perm() {
-        auto p = new int[point_count];
+    static double grad(int hash, double x, double y, double z) {
+        const float* g = perlin_gradients[hash & 15];
+        return g[0] * x + g[1] * y + g[2] * z;
+    }
+
+    //立方体8个角点的哈希值，第c个角点的偏移为(c&1, (c>>1)&1, (c>>2)&1)
+    void corner_hashes(int i, int j, int k, int* h) const {
+        int X = i & 255, Y = j & 255, Z = k & 255;
+        int A = perm[X] + Y, B = perm[X + 1] + Y;
+        int AA = perm[A] + Z, AB = perm[A + 1] + Z;
+        int BA = perm[B] + Z, BB = perm[B + 1] + Z;
+        h[0] = perm[AA];
+        h[1] = perm[BA];
+        h[2] = perm[AB];
+        h[3] = perm[BB];
+        h[4] = perm[AA + 1];
+        h[5] = perm[BA + 1];
+        h[6] = perm[AB + 1];
+        h[7] = perm[BB + 1];
+    }
+
+    //每4个八度调用一次noise4
+    double sum_octaves(const vec3& p, int octaves, bool absolute) const {
+        float x[4], y[4], z[4], n[4];
+        double accum = 0;
+        double weight = 1;
+        double freq = 1;
+        for (int o = 0; o < octaves; o += 4) {
+            double f = freq;
+            for (int k = 0; k < 4; k++) {
+                x[k] = static_cast<float>(f * p.x());
+                y[k] = static_cast<float>(f * p.y());
+                z[k] = static_cast<float>(f * p.z());
+                f *= 2;
+            }
+            noise4(x, y, z, n);
+            int count = octaves - o < 4 ? octaves - o : 4;
+            for (int k = 0; k < count; k++) {
+                accum += weight * (absolute ? fabs(n[k]) : n[k]);
+                weight *= 0.5;
+            }
+            freq = f;
+        }
+        return accum;
+    }
+
+#if PERLIN_SSE2
+    //SSE2没有floor指令，截断后对负数减1
+    static __m128i floor4(__m128 x) {
+        __m128i i = _mm_cvttps_epi32(x);
+        __m128 greater = _mm_cmpgt_ps(_mm_cvtepi32_ps(i), x);
+        return _mm_add_epi32(i, _mm_castps_si128(greater));
+    }
 
-        for (int i = 0; i < perlin::point_count; i++)
-            p[i] = i;
+    //和perlin_gradients查表结果相同，用比较和掩码代替查表：
+    //h<8取x否则取y作为u；h<4取y，h为12或14取x，否则取z作为v；h的最低两位决定u、v的符号
+    static __m128 grad4(__m128i h, __m128 x, __m128 y, __m128 z) {
+        h = _mm_and_si128(h, _mm_set1_epi32(15));
+        __m128 lt8 = _mm_castsi128_ps(_mm_cmplt_epi32(h, _mm_set1_epi32(8)));
+        __m128 lt4 = _mm_castsi128_ps(_mm_cmplt_epi32(h, _mm_set1_epi32(4)));
+        __m128 is_x = _mm_castsi128_ps(_mm_or_si128(_mm_cmpeq_epi32(h, _mm_set1_epi32(12)), _mm_cmpeq_epi32(h, _mm_set1_epi32(14))));
+        __m128 u = _mm_or_ps(_mm_and_ps(lt8, x), _mm_andnot_ps(lt8, y));
+        __m128 v = _mm_or_ps(_mm_and_ps(is_x, x), _mm_andnot_ps(is_x, z));
+        v = _mm_or_ps(_mm_and_ps(lt4, y), _mm_andnot_ps(lt4, v));
+        __m128 u_sign = _mm_castsi128_ps(_mm_slli_epi32(h, 31));
+        __m128 v_sign = _mm_castsi128_ps(_mm_slli_epi32(_mm_srli_epi32(h, 1), 31));
+        return _mm_add_ps(_mm_xor_ps(u, u_sign), _mm_xor_ps(v, v_sign));
+    }
 
-        permute(p, point_count);
+    static __m128 fade4(__m128 t) {
+        __m128 r = _mm_sub_ps(_mm_mul_ps(t, _mm_set1_ps(6)), _mm_set1_ps(15));
+        r = _mm_add_ps(_mm_mul_ps(t, r), _mm_set1_ps(10));
+        return _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(t, t), t), r);
+    }
 
-        return p;
+    static __m128 lerp4(__m128 t, __m128 a, __m128 b) {
+        return _mm_add_ps(a, _mm_mul_ps(t, _mm_sub_ps(b, a)));
     }
+#endif
 
     static void permute(int* p, int n) {
         for (int i = n - 1; i > 0; i--) {
@@ -88,5 +199,19 @@ private:
     }
 };
 
-#endif // !Perlin_H
+//把噪声映射成贴图用的[0,1]灰度
+inline double noise_value(const perlin& noise, noise_type type, double scale, const vec3& p) {
+    switch (type) {
+    case noise_fbm:
+        return 0.5 * (1 + noise.fbm(scale * p));
+    case noise_turbulence:
+        return noise.turb(scale * p);
+    case noise_marble:
+        //用湍流扰动正弦条纹的相位
+        return 0.5 * (1 + sin(scale * p.z() + 10 * noise.turb(p)));
+    default:
+        return 0.5 * (1 + noise.noise(scale * p));
+    }
+}
 
+#endif // !Perlin_H
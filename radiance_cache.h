@@ -0,0 +1,133 @@
+#ifndef RadianceCache_H
+#define RadianceCache_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include "vec3.h"
+
+/*
+*世界空间的辐亮度缓存：把漫反射表面按位置和法线所在的格子哈希到一张固定大小的表里，
+*每个格子累加在其中算出的反射辐亮度。路径经过一次漫反射之后，再击中样本数足够的格子时
+*直接取平均值，不再继续追踪。
+*格子边长随到相机的距离按2的幂增长，远处的格子大、近处的格子小；
+*cell_scale越小、min_samples越大，偏差越小，但能用上缓存的机会也越少。
+*表满时新的格子直接丢弃，内存固定为capacity个条目
+*/
+class radiance_cache {
+public:
+    //capacity会向上取到2的幂
+    radiance_cache(const vec3& camera_pos, double cell_scale = 0.01, int min_samples = 16, size_t capacity = 1 << 18)
+        : camera_pos(camera_pos), cell_scale(cell_scale), min_samples(min_samples) {
+        size = 1;
+        while (size < capacity)
+            size <<= 1;
+        entries.reset(new entry[size]);
+    }
+
+    //样本数达到min_samples时返回true
+    bool lookup(const vec3& p, const vec3& n, vec3& radiance) const {
+        const entry* e = find(key(p, n), false);
+        if (e == nullptr)
+            return false;
+        std::uint32_t count = e->count.load(std::memory_order_relaxed);
+        if (count < static_cast<std::uint32_t>(min_samples))
+            return false;
+        radiance = vec3(e->sum[0].load(std::memory_order_relaxed), e->sum[1].load(std::memory_order_relaxed),
+            e->sum[2].load(std::memory_order_relaxed)) / count;
+        return true;
+    }
+
+    //把p点算出的反射辐亮度加入所在格子
+    void update(const vec3& p, const vec3& n, const vec3& radiance) {
+        //NaN和负值会一直留在格子里，直接丢掉
+        if (!(radiance.x() >= 0 && radiance.y() >= 0 && radiance.z() >= 0))
+            return;
+        entry* e = const_cast<entry*>(find(key(p, n), true));
+        if (e == nullptr)
+            return;
+        for (int k = 0; k < 3; k++) {
+            double old = e->sum[k].load(std::memory_order_relaxed);
+            while (!e->sum[k].compare_exchange_weak(old, old + radiance[k], std::memory_order_relaxed)) {}
+        }
+        e->count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    //已经占用的条目数
+    size_t used() const {
+        size_t n = 0;
+        for (size_t i = 0; i < size; i++)
+            n += entries[i].key.load(std::memory_order_relaxed) != 0;
+        return n;
+    }
+
+    size_t capacity() const { return size; }
+
+private:
+    struct entry {
+        //0表示空
+        std::atomic<std::uint64_t> key;
+        std::atomic<double> sum[3];
+        std::atomic<std::uint32_t> count;
+
+        entry() : key(0), count(0) {
+            for (auto& s : sum)
+                s.store(0, std::memory_order_relaxed);
+        }
+    };
+
+    //线性探测的最大步数
+    static const int max_probes = 8;
+
+    vec3 camera_pos;
+    double cell_scale;
+    int min_samples;
+    size_t size;
+    std::unique_ptr<entry[]> entries;
+
+    /*
+    *键的组成：格子级别6位、法线的主轴和正负3位、三个坐标各18位。
+    *级别为floor(log2(到相机的距离*cell_scale))，格子边长为2^级别
+    */
+    std::uint64_t key(const vec3& p, const vec3& n) const {
+        double d = ffmax((p - camera_pos).length() * cell_scale, 1e-6);
+        int level = static_cast<int>(floor(log2(d)));
+        level = level < -31 ? -31 : (level > 31 ? 31 : level);
+        double inv_cell = ldexp(1.0, -level);
+
+        int axis = 0;
+        for (int a = 1; a < 3; a++)
+            if (fabs(n[a]) > fabs(n[axis]))
+                axis = a;
+        std::uint64_t k = std::uint64_t(level + 32) << 57 | std::uint64_t(axis * 2 + (n[axis] < 0)) << 54;
+        for (int a = 0; a < 3; a++) {
+            std::int64_t c = static_cast<std::int64_t>(floor(p[a] * inv_cell));
+            k |= (std::uint64_t(c) & 0x3FFFF) << (18 * a);
+        }
+        //保证不为0
+        return k | std::uint64_t(1) << 63;
+    }
+
+    const entry* find(std::uint64_t k, bool insert) const {
+        std::uint64_t h = k;
+        h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+        h ^= h >> 31;
+        for (int i = 0; i < max_probes; i++) {
+            entry& e = entries[(h + i) & (size - 1)];
+            std::uint64_t current = e.key.load(std::memory_order_acquire);
+            if (current == k)
+                return &e;
+            if (current == 0) {
+                if (!insert)
+                    return nullptr;
+                //别的线程可能同时占用这个位置，失败时看它写入的是不是同一个键
+                if (e.key.compare_exchange_strong(current, k, std::memory_order_acq_rel) || current == k)
+                    return &e;
+            }
+        }
+        return nullptr;
+    }
+};
+
+#endif // !RadianceCache_H
@@ -22,5 +22,9 @@ public:
     vec3 orig;
     vec3 dir;
     double tm;
+    //光线微分：相邻像素的两条光线，用于估计交点处贴图的采样范围
+    bool has_differentials = false;
+    vec3 rx_origin, rx_direction;
+    vec3 ry_origin, ry_direction;
 };
 #endif
\ No newline at end of file
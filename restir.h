@@ -0,0 +1,400 @@
+#ifndef Restir_H
+#define Restir_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "camera.h"
+#include "material.h"
+#include "light_sampler.h"
+#include "environment.h"
+
+/*
+*ReSTIR直接光照：每个像素用水塘（reservoir）从大量光源样本里按目标函数重采样出一个，
+*再从上一遍同一像素和这一遍邻近像素的水塘中继续重采样，相当于每个像素用上了邻居的候选，
+*而每个像素的开销固定。每一遍分成几步，都在渲染tile之前整幅图像做完：
+*1. 从相机出发穿过镜面，在第一个非镜面点记下G-buffer；
+*2. 每个像素在光源上取candidates个候选，按目标函数（不含可见性的直接光照亮度）选出一个；
+*3. 时域复用（temporal为true时）：与上一遍同一像素的水塘合并，历史样本数最多取当前的temporal_cap倍。
+*   单独一遍的噪声更小，但前后几遍的结果相关，累加多遍时收敛反而变慢，适合只看前几遍的预览；
+*4. 空域复用：与半径spatial_radius像素内spatial_neighbors个几何相近的邻居合并；
+*5. 渲染tile时用一条阴影光线检查所选样本，按水塘的权重计算直接光照，间接光照仍由路径追踪得到。
+*环境光不在水塘里，仍然单独采样。G-buffer和水塘不写进断点，续渲时时域复用从头开始
+*/
+class restir_di {
+public:
+    restir_di(const camera& cam, const hittable& world, const light_sampler& lights, const environment_map& background,
+        int max_depth, int width, int height, bool temporal = false, int candidates = 8, int spatial_neighbors = 5,
+        double spatial_radius = 30, double temporal_cap = 20)
+        : cam(cam), world(world), lights(lights), background(background), max_depth(max_depth),
+        width(width), height(height), temporal(temporal), candidates(candidates),
+        spatial_neighbors(spatial_neighbors < max_neighbors ? spatial_neighbors : max_neighbors),
+        spatial_radius(spatial_radius), temporal_cap(temporal_cap),
+        gbuffer(new surface[size_t(width) * height]), current(new reservoir[size_t(width) * height]),
+        history(new reservoir[size_t(width) * height]) {}
+
+    //生成这一遍的G-buffer和每个像素最终的水塘，seed决定这一遍的随机数
+    void prepare(std::uint64_t seed) {
+        parallel_for(height, [&](int j) {
+            seed_random(seed + j);
+            for (int i = 0; i < width; i++)
+                trace_camera(i, j);
+        });
+        parallel_for(height, [&](int j) {
+            seed_random(seed + height + j);
+            for (int i = 0; i < width; i++)
+                sample_candidates(i, j);
+        });
+        if (temporal && has_history) {
+            parallel_for(height, [&](int j) {
+                seed_random(seed + 2 * height + j);
+                for (int i = 0; i < width; i++)
+                    temporal_reuse(i, j);
+            });
+        }
+        //空域复用的结果同时作为下一遍的历史
+        parallel_for(height, [&](int j) {
+            seed_random(seed + 3 * height + j);
+            for (int i = 0; i < width; i++)
+                spatial_reuse(i, j);
+        });
+        has_history = true;
+    }
+
+    /*
+    *像素(i, j)这一遍的颜色。trace(r, depth, prev_normal, prev_pdf)继续追踪间接光照，
+    *prev_pdf取负值，表示场景光源的直接光照已经算过，击中光源时不再计入
+    */
+    template <typename Trace>
+    vec3 shade(int i, int j, Trace trace) const {
+        const surface& g = gbuffer[index(i, j)];
+        if (!g.valid)
+            return g.emitted;
+
+        vec3 L(0, 0, 0);
+        const reservoir& r = history[index(i, j)];
+        if (r.W > 0 && visible(g.rec.p, r.y, g.r_in.time()))
+            L += contribution(g, r.y) * r.W;
+
+        //环境光仍然和BSDF采样做MIS
+        if (!background.black()) {
+            vec3 to_env;
+            double env_pdf;
+            vec3 Le = background.sample(random_double(), random_double(), to_env, env_pdf);
+            ray shadow(g.rec.p, to_env, g.r_in.time());
+            vec3 f = g.rec.mat_ptr->eval(g.r_in, g.rec, g.albedo, shadow);
+            if (!is_black(f) && env_pdf > 0 && !world.occluded(shadow, 0.001, infinity))
+                L += f * Le * (power_heuristic(env_pdf, g.rec.mat_ptr->scattering_pdf(g.r_in, g.rec, shadow)) / env_pdf);
+        }
+
+        scatter_record srec;
+        if (g.rec.mat_ptr->scatter(g.r_in, g.rec, srec)) {
+            vec3 f = g.rec.mat_ptr->eval(g.r_in, g.rec, g.albedo, srec.scattered);
+            if (!is_black(f) && srec.pdf > 0)
+                L += f * trace(srec.scattered, g.depth - 1, g.rec.normal, -srec.pdf) / srec.pdf;
+        }
+        return g.emitted + g.beta * L;
+    }
+
+private:
+    //光源上的一个点，normal是发光的一面
+    struct light_sample {
+        vec3 p;
+        vec3 normal;
+        double u = 0, v = 0;
+        const material* mat = nullptr;
+    };
+
+    struct reservoir {
+        light_sample y;
+        double w_sum = 0;
+        //合并过的候选数
+        double M = 0;
+        //y的无偏贡献权重，着色时乘在y的贡献上
+        double W = 0;
+        //算出这个水塘的着色点，下一遍时域复用时用来判断几何是否相近
+        vec3 p;
+        vec3 normal;
+        double distance = 0;
+        const material* mat = nullptr;
+
+        bool update(const light_sample& s, double w) {
+            w_sum += w;
+            if (w > 0 && random_double() * w_sum < w) {
+                y = s;
+                return true;
+            }
+            return false;
+        }
+    };
+
+    //G-buffer：相机路径上第一个非镜面的点
+    struct surface {
+        hit_record rec;
+        ray r_in;
+        vec3 albedo;
+        //相机到该点的吞吐量
+        vec3 beta;
+        //该点之前的自发光、环境光之和
+        vec3 emitted;
+        //该点剩余的追踪深度和到相机的路径长度
+        int depth = 0;
+        double distance = 0;
+        bool valid = false;
+    };
+
+    const camera& cam;
+    const hittable& world;
+    //候选沿用渲染时的光源采样器
+    const light_sampler& lights;
+    const environment_map& background;
+    int max_depth;
+    int width, height;
+    bool temporal;
+    int candidates;
+    int spatial_neighbors;
+    double spatial_radius;
+    double temporal_cap;
+    std::unique_ptr<surface[]> gbuffer;
+    //current是初始候选和时域复用的结果，history是空域复用的结果
+    std::unique_ptr<reservoir[]> current;
+    std::unique_ptr<reservoir[]> history;
+    bool has_history = false;
+
+    //空域复用的邻居数上限，合并的开销和邻居数的平方成正比
+    static const int max_neighbors = 8;
+
+    size_t index(int i, int j) const { return size_t(j) * width + i; }
+
+    static bool is_black(const vec3& c) {
+        return c.x() <= 0 && c.y() <= 0 && c.z() <= 0;
+    }
+
+    //按线程数起worker，和渲染时一样从计数器领取任务
+    template <typename Work>
+    static void parallel_for(int count, Work work) {
+        std::atomic<int> next(0);
+        auto worker = [&]() {
+            for (int i = next++; i < count; i = next++)
+                work(i);
+        };
+        unsigned int thread_count = std::max(1u, std::thread::hardware_concurrency());
+        std::vector<std::thread> workers;
+        for (unsigned int t = 0; t < thread_count; t++)
+            workers.emplace_back(worker);
+        for (auto& w : workers)
+            w.join();
+    }
+
+    //光源样本y对着色点rec的直接光照，不含可见性
+    vec3 contribution(const hit_record& rec, const ray& r_in, const vec3& albedo, const light_sample& y) const {
+        vec3 d = y.p - rec.p;
+        double dist2 = d.length_squared();
+        if (!(dist2 > 0))
+            return vec3(0, 0, 0);
+        vec3 dir = d / sqrt(dist2);
+        double cos_light = -dot(dir, y.normal);
+        if (cos_light <= 0)
+            return vec3(0, 0, 0);
+        ray shadow(rec.p, dir, r_in.time());
+        vec3 f = rec.mat_ptr->eval(r_in, rec, albedo, shadow);
+        if (is_black(f))
+            return vec3(0, 0, 0);
+        hit_record light_rec;
+        light_rec.p = y.p;
+        light_rec.normal = y.normal;
+        light_rec.u = y.u;
+        light_rec.v = y.v;
+        light_rec.mat_ptr = y.mat;
+        light_rec.front_face = true;
+        return f * y.mat->emitted(shadow, light_rec, y.u, y.v, y.p) * (cos_light / dist2);
+    }
+
+    vec3 contribution(const surface& g, const light_sample& y) const {
+        return contribution(g.rec, g.r_in, g.albedo, y);
+    }
+
+    //目标函数取直接光照的亮度
+    double target(const surface& g, const light_sample& y) const {
+        return luminance(contribution(g, y));
+    }
+
+    bool visible(const vec3& p, const light_sample& y, double time) const {
+        vec3 d = y.p - p;
+        double dist = d.length();
+        return dist > 0 && !world.occluded(ray(p, d / dist, time), 0.001, dist - 0.001);
+    }
+
+    //两个着色点的法线夹角在25度以内、到相机的距离相差不到10%时才互相复用
+    static bool similar(const vec3& n0, double dist0, const vec3& n1, double dist1) {
+        return dot(n0, n1) > 0.9 && fabs(dist0 - dist1) < 0.1 * dist0;
+    }
+
+    void trace_camera(int i, int j) {
+        surface& g = gbuffer[index(i, j)];
+        g.valid = false;
+        g.emitted = vec3(0, 0, 0);
+        g.beta = vec3(1, 1, 1);
+        g.distance = 0;
+        ray r = cam.get_ray((i + random_double()) / width, (j + random_double()) / height, 1.0 / width, 1.0 / height);
+        for (int depth = max_depth; ; depth--) {
+            //和ray_color一样，超过深度时返回红色
+            if (depth <= 0) {
+                g.emitted += g.beta * vec3(1, 0, 0);
+                return;
+            }
+            hit_record rec;
+            if (!world.hit(r, 0.001, infinity, rec)) {
+                g.emitted += g.beta * background.value(r.direction());
+                return;
+            }
+            rec.compute_differentials(r);
+            g.distance += rec.t * r.direction().length();
+            //G-buffer之前都是镜面，击中光源时计入全部自发光
+            g.emitted += g.beta * rec.mat_ptr->emitted(r, rec, rec.u, rec.v, rec.p);
+
+            scatter_record srec;
+            if (!rec.mat_ptr->scatter(r, rec, srec))
+                return;
+            if (srec.is_specular) {
+                g.beta = g.beta * srec.attenuation;
+                r = srec.scattered;
+                continue;
+            }
+            g.rec = rec;
+            g.r_in = r;
+            g.albedo = srec.attenuation;
+            g.depth = depth;
+            g.valid = true;
+            return;
+        }
+    }
+
+    //和路径追踪的直接光照一样按立体角在光源上采样，pdf换算到面积上，近处的小光源也不会出现很大的权重
+    void sample_candidates(int i, int j) {
+        const surface& g = gbuffer[index(i, j)];
+        reservoir& r = current[index(i, j)];
+        r = reservoir();
+        if (!g.valid)
+            return;
+        for (int k = 0; k < candidates; k++) {
+            double light_pmf;
+            int light = lights.sample(g.rec.p, g.rec.normal, random_double(), light_pmf);
+            if (light < 0)
+                continue;
+            const hittable* emitter = lights.light(light);
+            ray shadow(g.rec.p, unit_vector(emitter->random(g.rec.p)), g.r_in.time());
+            double light_pdf = light_pmf * emitter->pdf_value(g.rec.p, shadow.direction());
+            hit_record light_rec;
+            //和光源共面时pdf是NaN，写成!(pdf > 0)一并排除
+            if (!(light_pdf > 0) || !emitter->hit(shadow, 0.001, infinity, light_rec))
+                continue;
+            light_sample s;
+            s.p = light_rec.p;
+            s.normal = light_rec.front_face ? light_rec.normal : -light_rec.normal;
+            s.u = light_rec.u;
+            s.v = light_rec.v;
+            s.mat = light_rec.mat_ptr;
+            double cos_light = fabs(dot(shadow.direction(), light_rec.normal));
+            double dist2 = (light_rec.p - g.rec.p).length_squared();
+            if (cos_light > 0 && dist2 > 0)
+                r.update(s, target(g, s) / (light_pdf * cos_light / dist2));
+        }
+        r.M = candidates;
+        double p_hat = r.w_sum > 0 ? target(g, r.y) : 0;
+        r.W = p_hat > 0 ? r.w_sum / (r.M * p_hat) : 0;
+        r.p = g.rec.p;
+        r.normal = g.rec.normal;
+        r.distance = g.distance;
+        r.mat = g.rec.mat_ptr;
+    }
+
+    /*
+    *把count个水塘按像素g的目标函数合并。domains[k]是生成inputs[k]的着色点，
+    *MIS权重用广义balance heuristic：M_k*p_k(y)/sum(M_j*p_j(y))，
+    *邻居离光源远近不同时目标函数相差很大，这样比按候选数平均的方差小得多。
+    *目标函数都不含可见性，可见性只在着色时检查一次，结果无偏
+    */
+    reservoir combine(const surface& g, int count, const surface* const* domains, const reservoir* const* inputs,
+        const double* M) const {
+        reservoir s;
+        for (int k = 0; k < count; k++) {
+            s.M += M[k];
+            const reservoir& r = *inputs[k];
+            if (r.W <= 0)
+                continue;
+            double p_hat = target(g, r.y);
+            if (!(p_hat > 0))
+                continue;
+            double p_k = 0, p_sum = 0;
+            for (int l = 0; l < count; l++) {
+                double p_l = l == 0 ? p_hat : target(*domains[l], r.y);
+                if (l == k)
+                    p_k = p_l;
+                p_sum += M[l] * p_l;
+            }
+            if (p_sum > 0)
+                s.update(r.y, M[k] * p_k / p_sum * p_hat * r.W);
+        }
+        double p_hat = s.w_sum > 0 ? target(g, s.y) : 0;
+        s.W = p_hat > 0 ? s.w_sum / p_hat : 0;
+        s.p = g.rec.p;
+        s.normal = g.rec.normal;
+        s.distance = g.distance;
+        s.mat = g.rec.mat_ptr;
+        return s;
+    }
+
+    void temporal_reuse(int i, int j) {
+        const surface& g = gbuffer[index(i, j)];
+        reservoir& r = current[index(i, j)];
+        const reservoir& prev = history[index(i, j)];
+        if (!g.valid || prev.M <= 0 || prev.mat != g.rec.mat_ptr
+            || !similar(g.rec.normal, g.distance, prev.normal, prev.distance))
+            return;
+
+        //上一遍的着色点只保存了位置和法线，材质相同，其余的用当前点代替
+        surface prev_surface = g;
+        prev_surface.rec.p = prev.p;
+        prev_surface.rec.normal = prev.normal;
+        const surface* domains[2] = { &g, &prev_surface };
+        const reservoir* inputs[2] = { &r, &prev };
+        double M[2] = { r.M, ffmin(prev.M, temporal_cap * r.M) };
+        r = combine(g, 2, domains, inputs, M);
+    }
+
+    void spatial_reuse(int i, int j) {
+        const surface& g = gbuffer[index(i, j)];
+        reservoir& out = history[index(i, j)];
+        out = current[index(i, j)];
+        if (!g.valid)
+            return;
+
+        //第一个是本像素
+        const surface* domains[max_neighbors + 1] = { &g };
+        const reservoir* inputs[max_neighbors + 1] = { &current[index(i, j)] };
+        double M[max_neighbors + 1] = { current[index(i, j)].M };
+        int count = 1;
+        for (int k = 0; k < spatial_neighbors; k++) {
+            double radius = spatial_radius * sqrt(random_double());
+            double theta = 2 * pi * random_double();
+            int x = i + static_cast<int>(floor(radius * cos(theta) + 0.5));
+            int y = j + static_cast<int>(floor(radius * sin(theta) + 0.5));
+            if (x < 0 || x >= width || y < 0 || y >= height || (x == i && y == j))
+                continue;
+            const surface& gq = gbuffer[index(x, y)];
+            if (!gq.valid || !similar(g.rec.normal, g.distance, gq.rec.normal, gq.distance))
+                continue;
+            domains[count] = &gq;
+            inputs[count] = &current[index(x, y)];
+            M[count] = current[index(x, y)].M;
+            count++;
+        }
+        out = combine(g, count, domains, inputs, M);
+    }
+};
+
+#endif // !Restir_H
@@ -1,7 +1,9 @@
 #ifndef RTWEEKEND_H
 #define RTWEEKEND_H
 
+#include <atomic>
 #include <cmath>
+#include <cstdint>
 #include <cstdlib>
 #include <limits>
 #include <memory>
@@ -12,19 +14,43 @@ using std::shared_ptr;
 using std::make_shared;
 
 
-//ֵ
+//无穷大值
 const double infinity = std::numeric_limits<double>::infinity();
 const double pi = 3.1415926535897932385;
 
-//ߺ
-//Ƕת
+//工具函数
+//角度转到弧度
 inline double degrees_to_radians(double degrees) {
 	return degrees * pi / 180;
 }
 
-// һ0-1֮
-inline double random_double() {    
-    return rand() / (RAND_MAX + 1.0);
+//splitmix64，用于把种子打散成随机数状态
+inline std::uint64_t splitmix64(std::uint64_t x) {
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+//每个线程独立的随机数状态，多线程渲染时不会像rand()一样互相加锁
+inline std::uint64_t& random_state() {
+    static std::atomic<std::uint64_t> thread_counter(0);
+    thread_local std::uint64_t state = splitmix64(++thread_counter) | 1;
+    return state;
+}
+
+inline void seed_random(std::uint64_t seed) {
+    random_state() = splitmix64(seed) | 1;
+}
+
+// 返回一个0-1之间的数
+inline double random_double() {
+    //xorshift64*
+    std::uint64_t& s = random_state();
+    s ^= s >> 12;
+    s ^= s << 25;
+    s ^= s >> 27;
+    return ((s * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
 }
 
 inline double clamp(double x, double min, double max) {
@@ -39,9 +65,9 @@ inline double random_double(double min, double max) {
     return min + (max - min) * random_double();
 }
 
-//ؽСֵ
+//返回较小值
 inline double ffmin(double a, double b) { return a <= b ? a : b; }
-//ؽϴֵ
+//返回较大值
 inline double ffmax(double a, double b) { return a >= b ? a : b; }
 
 // Common Headers
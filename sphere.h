@@ -2,7 +2,7 @@
 #define SPHERE_H
 
 #include "hittable.h"
-class material;
+#include "material.h"
 
 inline void get_sphere_uv(const vec3& p, double& u, double& v) {
     auto phi = atan2(p.z(), p.x());
@@ -11,13 +11,48 @@ inline void get_sphere_uv(const vec3& p, double& u, double& v) {
     v = (theta + pi / 2) / pi;
 }
 
+//只判断区间内是否存在根，不计算交点信息
+inline bool sphere_occluded(const vec3& center, double radius, const ray& r, double t_min, double t_max) {
+    vec3 oc = r.origin() - center;
+    auto a = r.direction().length_squared();
+    auto half_b = dot(oc, r.direction());
+    auto c = oc.length_squared() - radius * radius;
+    auto discriminant = half_b * half_b - a * c;
+
+    if (discriminant <= 0)
+        return false;
+
+    auto root = sqrt(discriminant);
+    auto temp = (-half_b - root) / a;
+    if (temp < t_max && temp > t_min)
+        return true;
+    temp = (-half_b + root) / a;
+    return temp < t_max && temp > t_min;
+}
+
+//get_sphere_uv参数化下交点对u、v的偏导，o为交点相对球心的偏移
+inline void get_sphere_dpduv(const vec3& o, vec3& dpdu, vec3& dpdv) {
+    dpdu = 2 * pi * vec3(o.z(), 0, -o.x());
+    auto rho = sqrt(o.x() * o.x() + o.z() * o.z());
+    if (rho < 1e-12)
+        dpdv = pi * vec3(0, o.length(), 0);
+    else
+        dpdv = pi * vec3(-o.y() * o.x() / rho, rho, -o.y() * o.z() / rho);
+}
+
 class sphere : public hittable {
 public:
     sphere() {}
     sphere(vec3 cen, double r, shared_ptr<material> m) : center(cen), radius(r), mat_ptr(m) {};
 
     virtual bool hit(const ray& r, double tmin, double tmax, hit_record& rec) const;
+    virtual bool occluded(const ray& r, double tmin, double tmax) const;
     virtual bool bounding_box(double t0, double t1, aabb& output_box) const;
+    virtual bool light_info(light_bounds& lb) const;
+    virtual double pdf_value(const vec3& o, const vec3& v) const;
+    virtual vec3 random(const vec3& o) const;
+    virtual bool sample_point(hit_record& rec, double& pdf) const;
+    virtual double pdf_point(const vec3& p) const;
 
 public:
     vec3 center;
@@ -26,7 +61,7 @@ public:
 };
 
 bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    //˴һԪηʽļ򻯼㣬Լȥ2
+    //此处是一元二次方程求根公式的简化计算，约去了2
     vec3 oc = r.origin() - center;
     auto a = r.direction().length_squared();
     auto half_b = dot(oc, r.direction());
@@ -35,32 +70,40 @@ bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) cons
 
     if (discriminant > 0) {
         auto root = sqrt(discriminant);
-        //ԴϽĵ
+        //这是离光源较近的点
         auto temp = (-half_b - root) / a;
         if (temp < t_max && temp > t_min) {
             rec.t = temp;
             rec.p = r.at(rec.t);
 			vec3 outward_normal = (rec.p - center) / radius;
 			rec.set_face_normal(r, outward_normal);
-            rec.mat_ptr = mat_ptr;
+            rec.mat_ptr = mat_ptr.get();
+            rec.object = this;
             get_sphere_uv((rec.p - center) / radius, rec.u, rec.v);
+            get_sphere_dpduv(rec.p - center, rec.dpdu, rec.dpdv);
             return true;
         }
-        //ԴԶĵ
+        //这是离光源较远的点
         temp = (-half_b + root) / a;
         if (temp < t_max && temp > t_min) {
             rec.t = temp;
             rec.p = r.at(rec.t);
 			vec3 outward_normal = (rec.p - center) / radius;
 			rec.set_face_normal(r, outward_normal);
-            rec.mat_ptr = mat_ptr;
+            rec.mat_ptr = mat_ptr.get();
+            rec.object = this;
             get_sphere_uv((rec.p - center) / radius, rec.u, rec.v);
+            get_sphere_dpduv(rec.p - center, rec.dpdu, rec.dpdv);
             return true;
         }
     }
     return false;
 }
 
+bool sphere::occluded(const ray& r, double t_min, double t_max) const {
+    return sphere_occluded(center, radius, r, t_min, t_max);
+}
+
 bool sphere::bounding_box(double t0, double t1, aabb& output_box) const {
     output_box = aabb(
         center - vec3(radius, radius, radius),
@@ -68,8 +111,118 @@ bool sphere::bounding_box(double t0, double t1, aabb& output_box) const {
     return true;
 }
 
+//球面向所有方向发光
+bool sphere::light_info(light_bounds& lb) const {
+    bounding_box(0, 1, lb.bounds);
+    lb.w = vec3(0, 0, 1);
+    lb.phi = 4 * pi * radius * radius;
+    lb.cos_theta_o = -1;
+    lb.cos_theta_e = 0;
+    lb.mat = mat_ptr.get();
+    return true;
+}
+
+//球面上按面积采样时对应的面积pdf，normal为该点的单位法线。
+//发光贴图有uv分布时按uv采样，uv到面积的雅可比为2*pi^2*r^2*cos(纬度)
+inline double sphere_area_pdf(const material* m, double radius, const vec3& normal) {
+    const distribution_2d* d = m ? m->emission_distribution() : nullptr;
+    if (!d)
+        return 1 / (4 * pi * radius * radius);
+    double u, v;
+    get_sphere_uv(normal, u, v);
+    double cos_latitude = sqrt(ffmax(1 - normal.y() * normal.y(), 0.0));
+    if (cos_latitude <= 0)
+        return 0;
+    return d->pdf(u, v) / (2 * pi * pi * radius * radius * cos_latitude);
+}
+
+//o在球外且发光不随uv变化时，在o看到的球冠所张的圆锥内按立体角均匀采样。
+//返回球冠圆锥的立体角，不满足条件时返回0
+inline double sphere_cone_solid_angle(const vec3& center, double radius, const material* m, const vec3& o) {
+    double dist2 = (center - o).length_squared();
+    if (dist2 <= radius * radius || (m && m->emission_distribution()))
+        return 0;
+    double sin2_max = radius * radius / dist2;
+    double cos_max = sqrt(ffmax(1 - sin2_max, 0.0));
+    //1-cos_max写成sin2/(1+cos)，远处的小球也不会因为相减丢失精度
+    return 2 * pi * sin2_max / (1 + cos_max);
+}
 
-//ƶ
+double sphere::pdf_value(const vec3& o, const vec3& v) const {
+    vec3 oc = o - center;
+    auto a = v.length_squared();
+    auto half_b = dot(oc, v);
+    auto c = oc.length_squared() - radius * radius;
+    auto discriminant = half_b * half_b - a * c;
+    if (discriminant <= 0)
+        return 0;
+
+    auto root = sqrt(discriminant);
+    double cone = sphere_cone_solid_angle(center, radius, mat_ptr.get(), o);
+    if (cone > 0)
+        return (-half_b + root) / a > 0.001 ? 1 / cone : 0;
+
+    //按面积采样时同一方向上前后两个交点都可能被采到，pdf要把两者加起来
+    double pdf = 0;
+    for (double t : { (-half_b - root) / a, (-half_b + root) / a }) {
+        if (t <= 0.001)
+            continue;
+        vec3 normal = (o + t * v - center) / radius;
+        auto cosine = fabs(dot(normal, v)) / sqrt(a);
+        pdf += t * t * a * sphere_area_pdf(mat_ptr.get(), radius, normal) / cosine;
+    }
+    return pdf;
+}
+
+vec3 sphere::random(const vec3& o) const {
+    double cone = sphere_cone_solid_angle(center, radius, mat_ptr.get(), o);
+    if (cone > 0) {
+        //圆锥内均匀采样：cos(theta)在[cos_max,1]上均匀分布
+        double one_minus_cos = random_double() * cone / (2 * pi);
+        double cos_theta = 1 - one_minus_cos;
+        double sin_theta = sqrt(ffmax(one_minus_cos * (2 - one_minus_cos), 0.0));
+        double phi = 2 * pi * random_double();
+        onb uvw(unit_vector(center - o));
+        return uvw.local(sin_theta * cos(phi), sin_theta * sin(phi), cos_theta);
+    }
+    if (!mat_ptr->emission_distribution())
+        return center + radius * random_unit_vector() - o;
+    //get_sphere_uv的逆变换
+    double u, v;
+    sample_emission_uv(mat_ptr.get(), u, v);
+    double phi = (1 - u) * 2 * pi - pi;
+    double theta = v * pi - pi / 2;
+    vec3 normal(cos(theta) * cos(phi), sin(theta), cos(theta) * sin(phi));
+    return center + radius * normal - o;
+}
+
+bool sphere::sample_point(hit_record& rec, double& pdf) const {
+    vec3 normal;
+    if (!mat_ptr->emission_distribution()) {
+        normal = random_unit_vector();
+    }
+    else {
+        double u, v;
+        sample_emission_uv(mat_ptr.get(), u, v);
+        double phi = (1 - u) * 2 * pi - pi;
+        double theta = v * pi - pi / 2;
+        normal = vec3(cos(theta) * cos(phi), sin(theta), cos(theta) * sin(phi));
+    }
+    rec.p = center + radius * normal;
+    rec.normal = normal;
+    rec.front_face = true;
+    rec.mat_ptr = mat_ptr.get();
+    rec.object = this;
+    get_sphere_uv(normal, rec.u, rec.v);
+    pdf = sphere_area_pdf(mat_ptr.get(), radius, normal);
+    return pdf > 0;
+}
+
+double sphere::pdf_point(const vec3& p) const {
+    return sphere_area_pdf(mat_ptr.get(), radius, unit_vector(p - center));
+}
+
+//移动的球
 class moving_sphere : public hittable {
 public:
     moving_sphere() {}
@@ -79,6 +232,7 @@ public:
     {};
 
     virtual bool hit(const ray& r, double tmin, double tmax, hit_record& rec) const;
+    virtual bool occluded(const ray& r, double tmin, double tmax) const;
     virtual bool bounding_box(double t0, double t1, aabb& output_box) const;
 
     vec3 center(double time) const;
@@ -106,14 +260,17 @@ bool moving_sphere::hit(
 
     if (discriminant > 0) {
         auto root = sqrt(discriminant);
-        //ѡĽ㱣
+        //选择最近的交点保存
         auto temp = (-half_b - root) / a;
         if (temp < t_max && temp > t_min) {
             rec.t = temp;
             rec.p = r.at(rec.t);
             vec3 outward_normal = (rec.p - center(r.time())) / radius;
             rec.set_face_normal(r, outward_normal);
-            rec.mat_ptr = mat_ptr;
+            rec.mat_ptr = mat_ptr.get();
+            rec.object = this;
+            get_sphere_uv(outward_normal, rec.u, rec.v);
+            get_sphere_dpduv(rec.p - center(r.time()), rec.dpdu, rec.dpdv);
 
             return true;
         }
@@ -124,13 +281,20 @@ bool moving_sphere::hit(
             rec.p = r.at(rec.t);
             vec3 outward_normal = (rec.p - center(r.time())) / radius;
             rec.set_face_normal(r, outward_normal);
-            rec.mat_ptr = mat_ptr;
+            rec.mat_ptr = mat_ptr.get();
+            rec.object = this;
+            get_sphere_uv(outward_normal, rec.u, rec.v);
+            get_sphere_dpduv(rec.p - center(r.time()), rec.dpdu, rec.dpdv);
             return true;
         }
     }
     return false;
 }
 
+bool moving_sphere::occluded(const ray& r, double t_min, double t_max) const {
+    return sphere_occluded(center(r.time()), radius, r, t_min, t_max);
+}
+
 bool moving_sphere::bounding_box(double t0, double t1, aabb& output_box) const {
     aabb box0(
         center(t0) - vec3(radius, radius, radius),
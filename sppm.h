@@ -0,0 +1,414 @@
+#ifndef SPPM_H
+#define SPPM_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "camera.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "light_sampler.h"
+#include "environment.h"
+#include "framebuffer.h"
+
+/*
+*随机渐进光子映射（SPPM）。每一遍：
+*1. 从相机出发穿过镜面反射/折射，在第一个非镜面点记下可见点，并在该点做直接光照；
+*2. 把所有可见点按搜索半径放进哈希网格；
+*3. 从光源发射光子，光子第二次及以后的击中点把能量累加到附近的可见点上；
+*4. 按统计量更新每个像素的半径和累积通量，半径逐遍缩小，结果逐渐收敛。
+*光子不保存，内存只和像素数有关。环境光只作为直接光照计入。
+*光子只从lights里的光源发射，不在lights里的发光物体只在可见点上直接看到时计入，
+*不提供间接光照；第一遍发现这样的物体时给出提示
+*/
+class sppm_integrator {
+public:
+    //initial_radius不大于0时取场景包围盒对角线的1%，photons_per_pass不大于0时取像素数
+    sppm_integrator(const camera& cam, const hittable& world, const hittable_list& lights, const light_sampler& sampler,
+        const environment_map& background, int max_depth, int width, int height,
+        double initial_radius = 0, int photons_per_pass = 0)
+        : cam(cam), world(world), emitters(lights), sampler(sampler), background(background),
+        max_depth(max_depth), width(width), height(height),
+        photons_per_pass(photons_per_pass > 0 ? photons_per_pass : width * height),
+        pixels(new sppm_pixel[size_t(width) * height]) {
+        if (initial_radius <= 0) {
+            aabb box;
+            initial_radius = world.bounding_box(0, 1, box) ? 0.01 * (box.max() - box.min()).length() : 1;
+        }
+        for (size_t i = 0; i < size_t(width) * height; i++)
+            pixels[i].radius = initial_radius;
+    }
+
+    //渲染一遍，seed决定这一遍的随机数
+    void iterate(std::uint64_t seed) {
+        trace_camera(seed);
+        if (passes == 0 && unlisted_emitter)
+            std::cerr << "SPPM: the scene has emitters that are not in lights, they emit no photons and light nothing indirectly\n";
+        build_grid();
+        trace_photons(seed);
+        update_pixels();
+        passes++;
+    }
+
+    //用当前的估计替换胶片内容，每个像素记为一个采样
+    void write_to(framebuffer& film) const {
+        film.clear();
+        if (passes == 0)
+            return;
+        double photon_count = double(passes) * photons_per_pass;
+        for (int j = 0; j < height; j++) {
+            for (int i = 0; i < width; i++) {
+                const sppm_pixel& p = pixels[size_t(j) * width + i];
+                vec3 L = p.direct / passes + p.tau / (photon_count * pi * p.radius * p.radius);
+                film.add_samples(i, j, L);
+            }
+        }
+    }
+
+    int pass_count() const { return passes; }
+
+private:
+    //可见点：相机路径上第一个非镜面的点
+    struct visible_point {
+        hit_record rec;
+        ray r_in;
+        vec3 albedo;
+        //相机到该点的吞吐量
+        vec3 beta;
+        bool valid = false;
+    };
+
+    struct sppm_pixel {
+        //自发光和直接光照的累加
+        vec3 direct = vec3(0, 0, 0);
+        visible_point vp;
+        double radius = 0;
+        //累计的有效光子数和缩放后的通量
+        double n = 0;
+        vec3 tau = vec3(0, 0, 0);
+        //这一遍落在半径内的光子通量和个数，多个线程同时累加
+        std::atomic<double> phi[3];
+        std::atomic<int> m;
+
+        sppm_pixel() : m(0) {
+            for (auto& c : phi)
+                c.store(0, std::memory_order_relaxed);
+        }
+    };
+
+    const camera& cam;
+    const hittable& world;
+    //光子按功率选光源发射
+    power_light_sampler emitters;
+    //可见点的直接光照沿用渲染时的光源采样器
+    const light_sampler& sampler;
+    const environment_map& background;
+    int max_depth;
+    int width, height;
+    int photons_per_pass;
+    int passes = 0;
+    std::unique_ptr<sppm_pixel[]> pixels;
+    //相机路径击中过不在lights里的发光物体
+    std::atomic<bool> unlisted_emitter{ false };
+
+    //哈希网格：cell_start[h]到cell_start[h+1]之间是落在哈希值为h的格子里的像素编号
+    aabb grid_bounds;
+    double cell_size = 1;
+    int grid_res[3] = { 1, 1, 1 };
+    std::vector<int> cell_start;
+    std::vector<int> cell_pixels;
+
+    //每次领取的光子数，也是光子随机数流的粒度
+    static const int photon_chunk = 4096;
+    //半径缩小的速度，取PPM论文中的2/3
+    static constexpr double alpha = 2.0 / 3.0;
+
+    static bool is_black(const vec3& c) {
+        return c.x() <= 0 && c.y() <= 0 && c.z() <= 0;
+    }
+
+    static void atomic_add(std::atomic<double>& a, double v) {
+        double old = a.load(std::memory_order_relaxed);
+        while (!a.compare_exchange_weak(old, old + v, std::memory_order_relaxed)) {}
+    }
+
+    //按线程数起worker，和渲染时一样从计数器领取任务
+    template <typename Work>
+    static void parallel_for(int count, Work work) {
+        std::atomic<int> next(0);
+        auto worker = [&]() {
+            for (int i = next++; i < count; i = next++)
+                work(i);
+        };
+        unsigned int thread_count = std::max(1u, std::thread::hardware_concurrency());
+        std::vector<std::thread> workers;
+        for (unsigned int t = 0; t < thread_count; t++)
+            workers.emplace_back(worker);
+        for (auto& w : workers)
+            w.join();
+    }
+
+    //可见点上的直接光照，光源和环境各采样一次
+    vec3 direct_light(const ray& r, const hit_record& rec, const vec3& albedo) const {
+        vec3 direct(0, 0, 0);
+        double light_pmf;
+        int light = sampler.sample(rec.p, rec.normal, random_double(), light_pmf);
+        if (light >= 0) {
+            const hittable* emitter = sampler.light(light);
+            ray shadow(rec.p, unit_vector(emitter->random(rec.p)), r.time());
+            vec3 f = rec.mat_ptr->eval(r, rec, albedo, shadow);
+            double light_pdf = light_pmf * emitter->pdf_value(rec.p, shadow.direction());
+            hit_record light_rec;
+            if (!is_black(f) && light_pdf > 0 && emitter->hit(shadow, 0.001, infinity, light_rec)
+                && !world.occluded(shadow, 0.001, light_rec.t - 0.001))
+                direct += f * light_rec.mat_ptr->emitted(shadow, light_rec, light_rec.u, light_rec.v, light_rec.p) / light_pdf;
+        }
+        if (!background.black()) {
+            vec3 to_env;
+            double env_pdf;
+            vec3 Le = background.sample(random_double(), random_double(), to_env, env_pdf);
+            ray shadow(rec.p, to_env, r.time());
+            vec3 f = rec.mat_ptr->eval(r, rec, albedo, shadow);
+            if (!is_black(f) && env_pdf > 0 && !world.occluded(shadow, 0.001, infinity))
+                direct += f * Le / env_pdf;
+        }
+        return direct;
+    }
+
+    void trace_camera(std::uint64_t seed) {
+        parallel_for(height, [&](int j) {
+            seed_random(seed + j);
+            for (int i = 0; i < width; i++) {
+                sppm_pixel& pixel = pixels[size_t(j) * width + i];
+                pixel.vp.valid = false;
+                ray r = cam.get_ray((i + random_double()) / width, (j + random_double()) / height, 1.0 / width, 1.0 / height);
+                vec3 beta(1, 1, 1);
+                for (int depth = 0; depth < max_depth; depth++) {
+                    hit_record rec;
+                    if (!world.hit(r, 0.001, infinity, rec)) {
+                        pixel.direct += beta * background.value(r.direction());
+                        break;
+                    }
+                    rec.compute_differentials(r);
+                    //可见点之前都是镜面，击中光源时计入全部自发光
+                    vec3 Le = rec.mat_ptr->emitted(r, rec, rec.u, rec.v, rec.p);
+                    pixel.direct += beta * Le;
+                    if (!is_black(Le) && emitters.find(rec.object) < 0)
+                        unlisted_emitter.store(true, std::memory_order_relaxed);
+
+                    scatter_record srec;
+                    if (!rec.mat_ptr->scatter(r, rec, srec))
+                        break;
+                    if (srec.is_specular) {
+                        beta = beta * srec.attenuation;
+                        r = srec.scattered;
+                        continue;
+                    }
+                    //间接光照全部由光子提供，直接光照不需要和BSDF采样做MIS
+                    pixel.direct += beta * direct_light(r, rec, srec.attenuation);
+                    pixel.vp.rec = rec;
+                    pixel.vp.r_in = r;
+                    pixel.vp.albedo = srec.attenuation;
+                    pixel.vp.beta = beta;
+                    pixel.vp.valid = true;
+                    break;
+                }
+            }
+        });
+    }
+
+    bool cell_of(const vec3& p, int c[3]) const {
+        for (int a = 0; a < 3; a++) {
+            c[a] = static_cast<int>(floor((p[a] - grid_bounds.min()[a]) / cell_size));
+            if (c[a] < 0 || c[a] >= grid_res[a])
+                return false;
+        }
+        return true;
+    }
+
+    size_t hash(int x, int y, int z) const {
+        std::uint64_t h = (std::uint64_t(x) * 73856093u) ^ (std::uint64_t(y) * 19349663u) ^ (std::uint64_t(z) * 83492791u);
+        return size_t(h % (cell_start.size() - 1));
+    }
+
+    //对一个可见点覆盖的每个格子调用f(hash)
+    template <typename F>
+    void for_each_cell(const sppm_pixel& pixel, F f) const {
+        vec3 r(pixel.radius, pixel.radius, pixel.radius);
+        int lo[3], hi[3];
+        for (int a = 0; a < 3; a++) {
+            lo[a] = std::max(0, static_cast<int>(floor((pixel.vp.rec.p[a] - r[a] - grid_bounds.min()[a]) / cell_size)));
+            hi[a] = std::min(grid_res[a] - 1, static_cast<int>(floor((pixel.vp.rec.p[a] + r[a] - grid_bounds.min()[a]) / cell_size)));
+        }
+        for (int z = lo[2]; z <= hi[2]; z++)
+            for (int y = lo[1]; y <= hi[1]; y++)
+                for (int x = lo[0]; x <= hi[0]; x++)
+                    f(hash(x, y, z));
+    }
+
+    /*
+    *格子边长取最大半径的两倍，每个可见点最多落在8个格子里。
+    *先并行统计每个哈希桶的数量，求前缀和后再并行填入，得到连续存放的数组
+    */
+    void build_grid() {
+        int count = width * height;
+        double max_radius = 0;
+        bool first = true;
+        for (int k = 0; k < count; k++) {
+            const sppm_pixel& p = pixels[k];
+            if (!p.vp.valid)
+                continue;
+            vec3 r(p.radius, p.radius, p.radius);
+            aabb box(p.vp.rec.p - r, p.vp.rec.p + r);
+            grid_bounds = first ? box : surrounding_box(grid_bounds, box);
+            first = false;
+            max_radius = ffmax(max_radius, p.radius);
+        }
+        cell_start.assign(size_t(count) + 1, 0);
+        cell_pixels.clear();
+        if (first)
+            return;
+
+        cell_size = 2 * max_radius;
+        vec3 extent = grid_bounds.max() - grid_bounds.min();
+        for (int a = 0; a < 3; a++)
+            grid_res[a] = std::max(1, static_cast<int>(ceil(extent[a] / cell_size)));
+
+        std::unique_ptr<std::atomic<int>[]> counts(new std::atomic<int>[count + 1]);
+        for (int k = 0; k <= count; k++)
+            counts[k].store(0, std::memory_order_relaxed);
+        parallel_for(height, [&](int j) {
+            for (int i = 0; i < width; i++) {
+                const sppm_pixel& p = pixels[size_t(j) * width + i];
+                if (p.vp.valid)
+                    for_each_cell(p, [&](size_t h) { counts[h]++; });
+            }
+        });
+        for (int k = 0; k < count; k++)
+            cell_start[k + 1] = cell_start[k] + counts[k].load();
+        cell_pixels.resize(cell_start[count]);
+        //counts改作每个桶的写入位置
+        for (int k = 0; k < count; k++)
+            counts[k].store(cell_start[k], std::memory_order_relaxed);
+        parallel_for(height, [&](int j) {
+            for (int i = 0; i < width; i++) {
+                int k = j * width + i;
+                const sppm_pixel& p = pixels[k];
+                if (p.vp.valid)
+                    for_each_cell(p, [&](size_t h) { cell_pixels[counts[h]++] = k; });
+            }
+        });
+    }
+
+    //把击中p点、沿dir到达的光子通量累加到附近的可见点
+    void deposit(const vec3& p, const vec3& dir, const vec3& beta) const {
+        int c[3];
+        if (cell_pixels.empty() || !cell_of(p, c))
+            return;
+        size_t h = hash(c[0], c[1], c[2]);
+        for (int e = cell_start[h]; e < cell_start[h + 1]; e++) {
+            sppm_pixel& pixel = pixels[cell_pixels[e]];
+            const visible_point& vp = pixel.vp;
+            if ((vp.rec.p - p).length_squared() > pixel.radius * pixel.radius)
+                continue;
+            //eval带有光子方向的cos，除掉后才是BSDF
+            ray to_photon(vp.rec.p, -dir, vp.r_in.time());
+            double cosine = fabs(dot(vp.rec.normal, unit_vector(dir)));
+            if (cosine < 1e-4)
+                continue;
+            vec3 flux = beta * vp.rec.mat_ptr->eval(vp.r_in, vp.rec, vp.albedo, to_photon) / cosine;
+            if (is_black(flux))
+                continue;
+            for (int a = 0; a < 3; a++)
+                atomic_add(pixel.phi[a], flux[a]);
+            pixel.m++;
+        }
+    }
+
+    void trace_photons(std::uint64_t seed) {
+        if (emitters.empty())
+            return;
+        int chunks = (photons_per_pass + photon_chunk - 1) / photon_chunk;
+        parallel_for(chunks, [&](int chunk) {
+            //光子的随机数流排在相机之后，和相机的行不重叠
+            seed_random(seed + height + chunk);
+            int end = std::min(photons_per_pass, (chunk + 1) * photon_chunk);
+            for (int k = chunk * photon_chunk; k < end; k++)
+                trace_photon();
+        });
+    }
+
+    void trace_photon() const {
+        double light_pmf;
+        int light = emitters.sample(vec3(0, 0, 0), vec3(0, 0, 0), random_double(), light_pmf);
+        if (light < 0)
+            return;
+        hit_record lrec;
+        double pdf_pos;
+        if (!emitters.light(light)->sample_point(lrec, pdf_pos) || pdf_pos <= 0)
+            return;
+        vec3 Le = lrec.mat_ptr->emitted(ray(), lrec, lrec.u, lrec.v, lrec.p);
+        if (is_black(Le))
+            return;
+        //按cos分布发射，cos和pdf中的cos相消
+        onb uvw(lrec.normal);
+        ray r(lrec.p, uvw.local(random_cosine_direction()), random_double(cam.time0, cam.time1));
+        vec3 beta = Le * pi / (light_pmf * pdf_pos);
+
+        for (int depth = 0; depth < max_depth; depth++) {
+            hit_record rec;
+            if (!world.hit(r, 0.001, infinity, rec))
+                break;
+            //第一次击中是直接光照，已经在可见点上算过
+            if (depth > 0)
+                deposit(rec.p, r.direction(), beta);
+
+            scatter_record srec;
+            if (!rec.mat_ptr->scatter(r, rec, srec))
+                break;
+            vec3 next;
+            if (srec.is_specular) {
+                next = beta * srec.attenuation;
+            }
+            else {
+                vec3 f = rec.mat_ptr->eval(r, rec, srec.attenuation, srec.scattered);
+                if (is_black(f) || srec.pdf <= 0)
+                    break;
+                next = beta * f / srec.pdf;
+            }
+            //俄罗斯轮盘赌：按吞吐量的衰减比例终止，保持光子能量大致不变
+            double q = ffmax(0.0, 1 - luminance(next) / luminance(beta));
+            if (random_double() < q)
+                break;
+            beta = next / (1 - q);
+            r = srec.scattered;
+        }
+    }
+
+    //按这一遍收集到的光子数缩小半径，并按面积比例缩放累积通量
+    void update_pixels() {
+        parallel_for(height, [&](int j) {
+            for (int i = 0; i < width; i++) {
+                sppm_pixel& p = pixels[size_t(j) * width + i];
+                int m = p.m.load();
+                if (m > 0) {
+                    double n_new = p.n + alpha * m;
+                    double r_new = p.radius * sqrt(n_new / (p.n + m));
+                    vec3 phi(p.phi[0].load(), p.phi[1].load(), p.phi[2].load());
+                    p.tau = (p.tau + p.vp.beta * phi) * (r_new * r_new) / (p.radius * p.radius);
+                    p.n = n_new;
+                    p.radius = r_new;
+                }
+                p.m = 0;
+                for (auto& c : p.phi)
+                    c.store(0, std::memory_order_relaxed);
+            }
+        });
+    }
+};
+
+#endif // !SPPM_H
@@ -4,12 +4,88 @@
 #include "rtweekend.h"
 #include "vec3.h"
 #include "perlin.h"
+#include <vector>
+
+struct texture_program;
 
 class texture {
 public:
     virtual vec3 value(double u, double v, const vec3& p) const = 0;
+    //width为一个像素在uv空间覆盖的宽度，只有需要滤波的贴图才用到
+    virtual vec3 value(double u, double v, const vec3& p, double width) const {
+        return value(u, v, p);
+    }
+    //把自己展开到扁平的贴图指令里，返回节点下标。默认生成一个调用虚函数value的节点
+    virtual int compile(texture_program& prog) const;
+};
+
+/*
+*贴图树展开后的扁平表示，节点按先序存放，根节点下标为0。
+*常量、棋盘格、噪声直接用switch求值，不再逐层做虚函数调用和指针跳转
+*/
+struct texture_program {
+    enum op_code { op_constant, op_checker, op_noise, op_texture };
+
+    struct node {
+        op_code op;
+        //op_constant的颜色
+        vec3 color;
+        //op_checker的两个子节点
+        int even = 0, odd = 0;
+        double scale = 1;
+        //op_noise的噪声和用法
+        const perlin* noise = nullptr;
+        noise_type noise_kind = noise_plain;
+        //op_texture退回到虚函数调用
+        const texture* tex = nullptr;
+    };
+
+    std::vector<node> nodes;
+
+    texture_program() {}
+    explicit texture_program(const texture& root) { root.compile(*this); }
+
+    int add(const node& n) {
+        nodes.push_back(n);
+        return static_cast<int>(nodes.size()) - 1;
+    }
+
+    bool is_constant() const { return nodes.size() == 1 && nodes[0].op == op_constant; }
+
+    vec3 value(double u, double v, const vec3& p, double width = 0) const {
+        int i = 0;
+        while (true) {
+            const node& n = nodes[i];
+            switch (n.op) {
+            case op_constant:
+                return n.color;
+            case op_checker:
+                i = checker_odd(p, n.scale) ? n.odd : n.even;
+                break;
+            case op_noise:
+                return vec3(1, 1, 1) * noise_value(*n.noise, n.noise_kind, n.scale, p);
+            default:
+                return n.tex->value(u, v, p, width);
+            }
+        }
+    }
+
+    //sin(s*x)*sin(s*y)*sin(s*z)<0等价于三个floor(s*x/pi)之和为奇数，省掉三次sin
+    static bool checker_odd(const vec3& p, double scale) {
+        double k = scale / pi;
+        long long n = static_cast<long long>(floor(k * p.x())) + static_cast<long long>(floor(k * p.y()))
+            + static_cast<long long>(floor(k * p.z()));
+        return (n & 1) != 0;
+    }
 };
 
+inline int texture::compile(texture_program& prog) const {
+    texture_program::node n;
+    n.op = texture_program::op_texture;
+    n.tex = this;
+    return prog.add(n);
+}
+
 class constant_texture : public texture {
 public:
     constant_texture() {}
@@ -19,6 +95,13 @@ public:
         return color;
     }
 
+    virtual int compile(texture_program& prog) const {
+        texture_program::node n;
+        n.op = texture_program::op_constant;
+        n.color = color;
+        return prog.add(n);
+    }
+
 public:
     vec3 color;
 };
@@ -29,13 +112,32 @@ public:
     checker_texture(shared_ptr<texture> t0, shared_ptr<texture> t1) : even(t0), odd(t1) {}
 
     virtual vec3 value(double u, double v, const vec3& p) const {
-        double sines = sin(10 * p.x()) * sin(10 * p.y()) * sin(10 * p.z());
-        if (sines < 0)
+        if (texture_program::checker_odd(p, 10))
             return odd->value(u, v, p);
         else
             return even->value(u, v, p);
     }
 
+    virtual vec3 value(double u, double v, const vec3& p, double width) const {
+        if (texture_program::checker_odd(p, 10))
+            return odd->value(u, v, p, width);
+        else
+            return even->value(u, v, p, width);
+    }
+
+    virtual int compile(texture_program& prog) const {
+        texture_program::node n;
+        n.op = texture_program::op_checker;
+        n.scale = 10;
+        int index = prog.add(n);
+        //先序展开，子节点排在后面
+        int e = even->compile(prog);
+        int o = odd->compile(prog);
+        prog.nodes[index].even = e;
+        prog.nodes[index].odd = o;
+        return index;
+    }
+
 public:
     shared_ptr<texture> odd;
     shared_ptr<texture> even;
@@ -44,13 +146,26 @@ public:
 class noise_texture : public texture {
 public:
     noise_texture() {}
+    noise_texture(double sc, noise_type t = noise_plain) : scale(sc), type(t) {}
 
     virtual vec3 value(double u, double v, const vec3& p) const {
-        return vec3(1, 1, 1) * noise.noise(p);
+        return vec3(1, 1, 1) * noise_value(noise, type, scale, p);
+    }
+
+    virtual int compile(texture_program& prog) const {
+        texture_program::node n;
+        n.op = texture_program::op_noise;
+        n.noise = &noise;
+        n.noise_kind = type;
+        n.scale = scale;
+        return prog.add(n);
     }
 
 public:
     perlin noise;
+    //噪声频率
+    double scale = 1;
+    noise_type type = noise_plain;
 };
 
 
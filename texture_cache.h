@@ -0,0 +1,433 @@
+#ifndef TextureCache_H
+#define TextureCache_H
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <sys/stat.h>
+#include "stb_image.h"
+#include "tgaimage.h"
+
+//sRGB编码和线性值之间的转换
+inline float srgb_to_linear(float c) {
+    return c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+}
+
+inline unsigned char linear_to_srgb8(float c) {
+    c = c < 0 ? 0 : (c > 1 ? 1 : c);
+    float s = c <= 0.0031308f ? 12.92f * c : 1.055f * powf(c, 1 / 2.4f) - 0.055f;
+    return static_cast<unsigned char>(s * 255 + 0.5f);
+}
+
+//8位sRGB到线性值的查找表
+inline const float* srgb8_to_linear_table() {
+    struct table {
+        float v[256];
+        table() {
+            for (int i = 0; i < 256; i++)
+                v[i] = srgb_to_linear(i / 255.0f);
+        }
+    };
+    static const table t;
+    return t.v;
+}
+
+/*
+*贴图按tile存储，一个tile是tile_size x tile_size个像素，边缘的tile补齐。
+*缓存文件里每个像素是3字节sRGB，读入内存时一次性转成线性空间的RGBA float，
+*每个像素占16字节，采样时可以直接用SIMD读取
+*/
+struct texture_tile {
+    static const int tile_size = 64;
+    static const int file_channels = 3;
+
+    struct alignas(16) texel4 {
+        float c[4];
+    };
+
+    std::vector<texel4> texels;
+
+    const float* texel(int i, int j) const {
+        return texels[i + tile_size * j].c;
+    }
+
+    size_t bytes() const { return texels.size() * sizeof(texel4) + sizeof(texture_tile); }
+};
+
+/*
+*一张转换成分块mipmap的图片。第一次打开时解码原图、生成各层mipmap，
+*按tile写入缓存文件（原图路径加.tiles），之后只在需要时从缓存文件读取单个tile
+*/
+class tiled_image {
+public:
+    struct level_info {
+        int nx, ny;
+        int tiles_x, tiles_y;
+        std::uint64_t offset;
+    };
+
+    int id = 0;
+    std::string path;
+    std::vector<level_info> levels;
+
+    int width() const { return levels.empty() ? 0 : levels[0].nx; }
+    int height() const { return levels.empty() ? 0 : levels[0].ny; }
+
+    bool open(const std::string& filename, int image_id);
+    std::shared_ptr<const texture_tile> read_tile(int level, int tx, int ty);
+
+    ~tiled_image() {
+        if (file)
+            fclose(file);
+    }
+
+private:
+    //缓存文件中一个tile的字节数
+    static const std::uint64_t tile_bytes = std::uint64_t(texture_tile::tile_size) * texture_tile::tile_size * texture_tile::file_channels;
+
+    struct file_header {
+        char magic[4] = { 'R','T','T','X' };
+        std::uint32_t version = 2;
+        std::uint64_t source_size = 0;
+        std::int64_t source_mtime = 0;
+        std::int32_t nx = 0, ny = 0;
+        std::int32_t tile = texture_tile::tile_size;
+        std::int32_t nlevels = 0;
+    };
+
+    bool load_tiled_file(const std::string& tiled, const file_header& expected);
+    bool convert(const std::string& tiled, const file_header& source);
+    void layout_levels(int nx, int ny);
+
+    std::mutex file_mutex;
+    FILE* file = nullptr;
+    //缓存文件写不出来时，tile数据保留在内存里，仍然按tile读取
+    std::vector<unsigned char> backing;
+};
+
+/*
+*所有图片共享的tile缓存，总内存超过预算时淘汰最久未使用的tile。
+*线程本地缓存命中时不经过全局锁，不会刷新全局LRU，所以淘汰时跳过仍被线程缓存持有的tile，
+*把它们当作刚用过移回链表头部。被持有的tile即使淘汰也释放不了内存，所以留在缓存里并计入used
+*/
+class texture_cache {
+public:
+    static texture_cache& instance() {
+        static texture_cache cache;
+        return cache;
+    }
+
+    //同一路径只加载一次
+    std::shared_ptr<tiled_image> open(const std::string& path);
+
+    //先查线程自己的小缓存，不命中再加锁查全局缓存，最后才读文件
+    const texture_tile* tile(tiled_image& image, int level, int tx, int ty);
+
+    void set_memory_budget(size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        budget = bytes;
+        evict();
+    }
+
+    size_t memory_used() const { return used.load(); }
+
+    void print_stats() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::cerr << "texture cache: " << used / (1024.0 * 1024.0) << "/" << budget / (1024.0 * 1024.0) << " MB, "
+            << loads << " tile loads, " << evictions << " evictions\n";
+    }
+
+private:
+    struct entry {
+        std::uint64_t key;
+        std::shared_ptr<const texture_tile> tile;
+    };
+
+    //线程本地的直接映射缓存，持有shared_ptr，全局淘汰后tile仍然有效
+    struct thread_cache {
+        static const int slots = 64;
+        std::uint64_t keys[slots];
+        std::shared_ptr<const texture_tile> tiles[slots];
+
+        thread_cache() {
+            for (int i = 0; i < slots; i++)
+                keys[i] = ~std::uint64_t(0);
+        }
+    };
+
+    static std::uint64_t tile_key(int id, int level, int tx, int ty) {
+        return (std::uint64_t(id) << 44) | (std::uint64_t(level) << 40) | (std::uint64_t(ty) << 20) | std::uint64_t(tx);
+    }
+
+    void evict();
+
+    std::mutex mutex;
+    std::unordered_map<std::string, std::shared_ptr<tiled_image>> images;
+    //最近使用的tile在链表头部
+    std::list<entry> lru;
+    std::unordered_map<std::uint64_t, std::list<entry>::iterator> tiles;
+    size_t budget = size_t(64) << 20;
+    //在锁内修改，memory_used()可以不加锁读取
+    std::atomic<size_t> used{ 0 };
+    size_t loads = 0;
+    size_t evictions = 0;
+};
+
+void tiled_image::layout_levels(int nx, int ny) {
+    levels.clear();
+    std::uint64_t offset = sizeof(file_header);
+    while (true) {
+        level_info info;
+        info.nx = nx;
+        info.ny = ny;
+        info.tiles_x = (nx + texture_tile::tile_size - 1) / texture_tile::tile_size;
+        info.tiles_y = (ny + texture_tile::tile_size - 1) / texture_tile::tile_size;
+        info.offset = offset;
+        offset += std::uint64_t(info.tiles_x) * info.tiles_y * tile_bytes;
+        levels.push_back(info);
+        if (nx == 1 && ny == 1)
+            break;
+        nx = nx > 1 ? nx / 2 : 1;
+        ny = ny > 1 ? ny / 2 : 1;
+    }
+}
+
+bool tiled_image::open(const std::string& filename, int image_id) {
+    id = image_id;
+    path = filename;
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0) {
+        std::cerr << "can't open file " << filename << "\n";
+        return false;
+    }
+    file_header source;
+    source.source_size = std::uint64_t(st.st_size);
+    source.source_mtime = std::int64_t(st.st_mtime);
+
+    //缓存文件和原图的大小、修改时间一致时直接使用
+    std::string tiled = filename + ".tiles";
+    if (load_tiled_file(tiled, source))
+        return true;
+    return convert(tiled, source);
+}
+
+bool tiled_image::load_tiled_file(const std::string& tiled, const file_header& expected) {
+    FILE* f = fopen(tiled.c_str(), "rb");
+    if (!f)
+        return false;
+    file_header header;
+    if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, expected.magic, 4) != 0
+        || header.version != expected.version || header.tile != expected.tile
+        || header.source_size != expected.source_size || header.source_mtime != expected.source_mtime) {
+        fclose(f);
+        return false;
+    }
+    //写到一半的缓存文件头部完整但长度不够，按各层布局算出应有的长度来检查
+    if (header.nx <= 0 || header.ny <= 0 || header.nx > (1 << 20) || header.ny > (1 << 20)) {
+        fclose(f);
+        return false;
+    }
+    layout_levels(header.nx, header.ny);
+    const level_info& last = levels.back();
+    std::uint64_t expected_size = last.offset + std::uint64_t(last.tiles_x) * last.tiles_y * tile_bytes;
+    struct stat st;
+    if (stat(tiled.c_str(), &st) != 0 || std::uint64_t(st.st_size) != expected_size) {
+        std::cerr << tiled << " is incomplete, converting " << path << " again\n";
+        fclose(f);
+        return false;
+    }
+    file = f;
+    return true;
+}
+
+bool tiled_image::convert(const std::string& tiled, const file_header& source) {
+    int nx, ny, nn;
+    unsigned char* pixels = stbi_load(path.c_str(), &nx, &ny, &nn, texture_tile::file_channels);
+    if (pixels == nullptr) {
+        std::cerr << "Cannot load texture " << path << "\n";
+        return false;
+    }
+    layout_levels(nx, ny);
+    file_header header = source;
+    header.nx = nx;
+    header.ny = ny;
+    header.nlevels = static_cast<std::int32_t>(levels.size());
+
+    const level_info& last = levels.back();
+    backing.assign(size_t(last.offset + std::uint64_t(last.tiles_x) * last.tiles_y * tile_bytes), 0);
+    memcpy(backing.data(), &header, sizeof(header));
+
+    //在线性空间里生成mipmap，每层再编码回8位sRGB写入tile
+    const float* to_linear = srgb8_to_linear_table();
+    std::vector<float> src(size_t(3) * nx * ny);
+    for (size_t k = 0; k < src.size(); k++)
+        src[k] = to_linear[pixels[k]];
+    stbi_image_free(pixels);
+    for (size_t l = 0; l < levels.size(); l++) {
+        const level_info& info = levels[l];
+        //逐层做2x2盒式滤波，奇数边长时最后一行/列并入前一个像素
+        if (l > 0) {
+            const level_info& prev = levels[l - 1];
+            std::vector<float> dst(size_t(3) * info.nx * info.ny);
+            for (int j = 0; j < info.ny; j++) {
+                int j0 = prev.ny > 1 ? 2 * j : 0;
+                int j1 = (j == info.ny - 1) ? prev.ny : j0 + 2;
+                for (int i = 0; i < info.nx; i++) {
+                    int i0 = prev.nx > 1 ? 2 * i : 0;
+                    int i1 = (i == info.nx - 1) ? prev.nx : i0 + 2;
+                    float count = float((i1 - i0) * (j1 - j0));
+                    for (int c = 0; c < 3; c++) {
+                        float sum = 0;
+                        for (int y = j0; y < j1; y++)
+                            for (int x = i0; x < i1; x++)
+                                sum += src[3 * (x + size_t(prev.nx) * y) + c];
+                        dst[3 * (i + size_t(info.nx) * j) + c] = sum / count;
+                    }
+                }
+            }
+            src.swap(dst);
+        }
+        //拷贝到各个tile中
+        for (int j = 0; j < info.ny; j++) {
+            int ty = j / texture_tile::tile_size;
+            for (int tx = 0; tx < info.tiles_x; tx++) {
+                int i0 = tx * texture_tile::tile_size;
+                int i1 = std::min(i0 + texture_tile::tile_size, info.nx);
+                size_t tile_offset = size_t(info.offset + (std::uint64_t(ty) * info.tiles_x + tx) * tile_bytes);
+                unsigned char* dst = backing.data() + tile_offset + size_t(3) * texture_tile::tile_size * (j % texture_tile::tile_size);
+                const float* row = src.data() + 3 * (i0 + size_t(info.nx) * j);
+                for (int k = 0; k < 3 * (i1 - i0); k++)
+                    dst[k] = linear_to_srgb8(row[k]);
+            }
+        }
+    }
+
+    //先写临时文件，完整写出后再替换，中途失败不会留下残缺的缓存文件
+    std::string temp = tiled + ".tmp";
+    FILE* f = fopen(temp.c_str(), "wb");
+    bool written = f && fwrite(backing.data(), backing.size(), 1, f) == 1;
+    if (f && fclose(f) != 0)
+        written = false;
+    if (!written || !replace_file(temp, tiled)) {
+        std::remove(temp.c_str());
+        std::cerr << "can't write " << tiled << ", keeping " << path << " in memory\n";
+        return true;
+    }
+    //写成功后释放内存，之后按需从文件读取
+    std::vector<unsigned char>().swap(backing);
+    file = fopen(tiled.c_str(), "rb");
+    return file != nullptr;
+}
+
+std::shared_ptr<const texture_tile> tiled_image::read_tile(int level, int tx, int ty) {
+    const level_info& info = levels[level];
+    std::uint64_t offset = info.offset + (std::uint64_t(ty) * info.tiles_x + tx) * tile_bytes;
+    std::vector<unsigned char> raw(static_cast<size_t>(tile_bytes));
+    if (!backing.empty()) {
+        memcpy(raw.data(), backing.data() + offset, size_t(tile_bytes));
+    }
+    else {
+        std::lock_guard<std::mutex> lock(file_mutex);
+#ifdef _WIN32
+        bool ok = _fseeki64(file, static_cast<long long>(offset), SEEK_SET) == 0;
+#else
+        bool ok = fseeko(file, static_cast<off_t>(offset), SEEK_SET) == 0;
+#endif
+        if (!ok || fread(raw.data(), size_t(tile_bytes), 1, file) != 1)
+            std::cerr << "an error occured while reading " << path << ".tiles\n";
+    }
+
+    //转成线性空间的RGBA float，之后采样不再做任何转换
+    const float* to_linear = srgb8_to_linear_table();
+    auto tile = std::make_shared<texture_tile>();
+    tile->texels.resize(size_t(texture_tile::tile_size) * texture_tile::tile_size);
+    for (size_t k = 0; k < tile->texels.size(); k++) {
+        const unsigned char* c = raw.data() + 3 * k;
+        texture_tile::texel4& t = tile->texels[k];
+        t.c[0] = to_linear[c[0]];
+        t.c[1] = to_linear[c[1]];
+        t.c[2] = to_linear[c[2]];
+        t.c[3] = 1.0f;
+    }
+    return tile;
+}
+
+std::shared_ptr<tiled_image> texture_cache::open(const std::string& path) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = images.find(path);
+    if (found != images.end())
+        return found->second;
+    auto image = std::make_shared<tiled_image>();
+    if (!image->open(path, static_cast<int>(images.size())))
+        image = nullptr;
+    images[path] = image;
+    return image;
+}
+
+const texture_tile* texture_cache::tile(tiled_image& image, int level, int tx, int ty) {
+    thread_local thread_cache local;
+    std::uint64_t key = tile_key(image.id, level, tx, ty);
+    int slot = static_cast<int>((key ^ (key >> 20) ^ (key >> 40)) % thread_cache::slots);
+    if (local.keys[slot] == key)
+        return local.tiles[slot].get();
+
+    std::shared_ptr<const texture_tile> result;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = tiles.find(key);
+        if (found != tiles.end()) {
+            lru.splice(lru.begin(), lru, found->second);
+            result = found->second->tile;
+        }
+    }
+    if (!result) {
+        //读文件时不持有全局锁
+        auto loaded = image.read_tile(level, tx, ty);
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = tiles.find(key);
+        if (found != tiles.end()) {
+            result = found->second->tile;
+        }
+        else {
+            lru.push_front({ key, loaded });
+            tiles[key] = lru.begin();
+            used += loaded->bytes();
+            loads++;
+            result = loaded;
+            evict();
+        }
+    }
+    local.keys[slot] = key;
+    local.tiles[slot] = result;
+    return result.get();
+}
+
+void texture_cache::evict() {
+    //每个tile最多检查一次，全部被线程缓存持有时允许暂时超出预算。至少保留一个tile
+    size_t remaining = lru.size();
+    while (used > budget && lru.size() > 1 && remaining-- > 0) {
+        const entry& oldest = lru.back();
+        //除了全局缓存还有别的持有者，说明某个线程的本地缓存里还有它，移到头部
+        if (oldest.tile.use_count() > 1) {
+            lru.splice(lru.begin(), lru, std::prev(lru.end()));
+            continue;
+        }
+        used -= oldest.tile->bytes();
+        tiles.erase(oldest.key);
+        lru.pop_back();
+        evictions++;
+    }
+}
+
+#endif // !TextureCache_H
@@ -1,117 +1,284 @@
 #include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
 #include <cstring>
+#include <thread>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TGA_SSE2 1
+#endif
+#if defined(__SSSE3__) || defined(__AVX__)
+#include <tmmintrin.h>
+#define TGA_SSSE3 1
+#endif
 #include "tgaimage.h"
 
 TGAImage::TGAImage(const int w, const int h, const int bpp) : w(w), h(h), bpp(bpp), data(w* h* bpp, 0) {}
 
-bool TGAImage::read_tga_file(const std::string filename) {
-    std::ifstream in;
-    in.open(filename, std::ios::binary);
-    if (!in.is_open()) {
+namespace {
+    // read-only view of a whole file, unmapped when it goes out of scope
+    struct MappedFile {
+        const std::uint8_t* data = nullptr;
+        size_t size = 0;
+#ifdef _WIN32
+        HANDLE file = INVALID_HANDLE_VALUE;
+        HANDLE mapping = nullptr;
+
+        bool open(const std::string& filename) {
+            file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+            if (file == INVALID_HANDLE_VALUE)
+                return false;
+            LARGE_INTEGER filesize;
+            if (!GetFileSizeEx(file, &filesize) || filesize.QuadPart == 0)
+                return false;
+            size = static_cast<size_t>(filesize.QuadPart);
+            mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (!mapping)
+                return false;
+            data = static_cast<const std::uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+            return data != nullptr;
+        }
+
+        ~MappedFile() {
+            if (data) UnmapViewOfFile(data);
+            if (mapping) CloseHandle(mapping);
+            if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        }
+#else
+        int fd = -1;
+
+        bool open(const std::string& filename) {
+            fd = ::open(filename.c_str(), O_RDONLY);
+            if (fd < 0)
+                return false;
+            struct stat st;
+            if (fstat(fd, &st) != 0 || st.st_size == 0)
+                return false;
+            size = static_cast<size_t>(st.st_size);
+            void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED)
+                return false;
+            data = static_cast<const std::uint8_t*>(p);
+            madvise(p, size, MADV_SEQUENTIAL);
+            return true;
+        }
+
+        ~MappedFile() {
+            if (data) munmap(const_cast<std::uint8_t*>(data), size);
+            if (fd >= 0) ::close(fd);
+        }
+#endif
+    };
+}
+
+bool TGAImage::read_tga_file(const std::string filename, const bool reorient) {
+    auto start = std::chrono::steady_clock::now();
+    MappedFile file;
+    if (!file.open(filename)) {
         std::cerr << "can't open file " << filename << "\n";
-        in.close();
         return false;
     }
     TGAHeader header;
-    in.read(reinterpret_cast<char*>(&header), sizeof(header));
-    if (!in.good()) {
-        in.close();
+    if (file.size < sizeof(header)) {
         std::cerr << "an error occured while reading the header\n";
         return false;
     }
+    memcpy(&header, file.data, sizeof(header));
     w = header.width;
     h = header.height;
     bpp = header.bitsperpixel >> 3;
     if (w <= 0 || h <= 0 || (bpp != GRAYSCALE && bpp != RGB && bpp != RGBA)) {
-        in.close();
         std::cerr << "bad bpp (or width/height) value\n";
         return false;
     }
-    size_t nbytes = bpp * w * h;
-    data = std::vector<std::uint8_t>(nbytes, 0);
+    // skip the image id and the (unused) color map
+    size_t offset = sizeof(header) + header.idlength;
+    if (header.colormaptype)
+        offset += size_t(header.colormaplength) * ((header.colormapdepth + 7) >> 3);
+    if (offset > file.size) {
+        std::cerr << "an error occured while reading the header\n";
+        return false;
+    }
+    const std::uint8_t* in = file.data + offset;
+    const std::uint8_t* end = file.data + file.size;
+    // pixels go straight to their final place: no flip pass afterwards.
+    // without reorienting they stay in file order and origin() tells where the first one is
+    const bool vflip = reorient && !(header.imagedescriptor & 0x20);
+    const bool hflip = reorient && (header.imagedescriptor & 0x10) != 0;
+    origin_bits = reorient ? 0x20 : (header.imagedescriptor & 0x30);
+    file_order = !reorient;
+    data = std::vector<std::uint8_t>(size_t(bpp) * w * h, 0);
     if (3 == header.datatypecode || 2 == header.datatypecode) {
-        in.read(reinterpret_cast<char*>(data.data()), nbytes);
-        if (!in.good()) {
-            in.close();
+        const size_t rowbytes = size_t(w) * bpp;
+        if (size_t(end - in) < rowbytes * h) {
             std::cerr << "an error occured while reading the data\n";
             return false;
         }
+        for (int y = 0; y < h; y++, in += rowbytes) {
+            std::uint8_t* dst = data.data() + size_t(vflip ? h - 1 - y : y) * rowbytes;
+            if (!hflip)
+                memcpy(dst, in, rowbytes);
+            else
+                for (int x = 0; x < w; x++)
+                    memcpy(dst + size_t(w - 1 - x) * bpp, in + size_t(x) * bpp, bpp);
+        }
     }
     else if (10 == header.datatypecode || 11 == header.datatypecode) {
-        if (!load_rle_data(in)) {
-            in.close();
+        if (!load_rle_data(in, end, vflip, hflip)) {
             std::cerr << "an error occured while reading the data\n";
             return false;
         }
     }
     else {
-        in.close();
         std::cerr << "unknown file format " << (int)header.datatypecode << "\n";
         return false;
     }
-    if (!(header.imagedescriptor & 0x20))
-        flip_vertically();
-    if (header.imagedescriptor & 0x10)
-        flip_horizontally();
-    std::cerr << (int)header.datatypecode << "/" << w << "x" << h << "/" << bpp * 8 << "\n";
-    in.close();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double megabytes = file.size / (1024.0 * 1024.0);
+    std::cerr << (int)header.datatypecode << "/" << w << "x" << h << "/" << bpp * 8
+        << " (" << megabytes << " MB, " << (seconds > 0 ? megabytes / seconds : 0) << " MB/s)\n";
     return true;
 }
 
-bool TGAImage::load_rle_data(std::ifstream& in) {
-    size_t pixelcount = w * h;
-    size_t currentpixel = 0;
-    size_t currentbyte = 0;
-    TGAColor colorbuffer;
-    do {
-        std::uint8_t chunkheader = 0;
-        chunkheader = in.get();
-        if (!in.good()) {
+// packets may cross scanlines, the destination pointer jumps to the next (possibly flipped) row when one is full
+bool TGAImage::load_rle_data(const std::uint8_t* in, const std::uint8_t* end, const bool vflip, const bool hflip) {
+    const size_t rowbytes = size_t(w) * bpp;
+    const std::ptrdiff_t step = hflip ? -bpp : bpp;
+    int y = 0;
+    int left = 0;
+    std::uint8_t* dst = nullptr;
+    auto next_row = [&]() {
+        std::uint8_t* row = data.data() + size_t(vflip ? h - 1 - y : y) * rowbytes;
+        dst = hflip ? row + rowbytes - bpp : row;
+        left = w;
+        y++;
+    };
+    next_row();
+    while (true) {
+        if (in >= end) {
             std::cerr << "an error occured while reading the data\n";
             return false;
         }
-        if (chunkheader < 128) {
-            chunkheader++;
-            for (int i = 0; i < chunkheader; i++) {
-                in.read(reinterpret_cast<char*>(colorbuffer.bgra), bpp);
-                if (!in.good()) {
-                    std::cerr << "an error occured while reading the header\n";
-                    return false;
-                }
-                for (int t = 0; t < bpp; t++)
-                    data[currentbyte++] = colorbuffer.bgra[t];
-                currentpixel++;
-                if (currentpixel > pixelcount) {
-                    std::cerr << "Too many pixels read\n";
-                    return false;
-                }
-            }
+        int count = (*in & 0x7f) + 1;
+        bool run = (*in++ & 0x80) != 0;
+        if (end - in < (run ? bpp : count * bpp)) {
+            std::cerr << "an error occured while reading the data\n";
+            return false;
         }
-        else {
-            chunkheader -= 127;
-            in.read(reinterpret_cast<char*>(colorbuffer.bgra), bpp);
-            if (!in.good()) {
-                std::cerr << "an error occured while reading the header\n";
-                return false;
+        while (count > 0) {
+            int n = std::min(count, left);
+            if (run) {
+                for (int i = 0; i < n; i++, dst += step)
+                    memcpy(dst, in, bpp);
+            }
+            else if (!hflip) {
+                memcpy(dst, in, size_t(n) * bpp);
+                dst += size_t(n) * bpp;
+                in += size_t(n) * bpp;
+            }
+            else {
+                for (int i = 0; i < n; i++, dst += step, in += bpp)
+                    memcpy(dst, in, bpp);
             }
-            for (int i = 0; i < chunkheader; i++) {
-                for (int t = 0; t < bpp; t++)
-                    data[currentbyte++] = colorbuffer.bgra[t];
-                currentpixel++;
-                if (currentpixel > pixelcount) {
-                    std::cerr << "Too many pixels read\n";
-                    return false;
+            count -= n;
+            left -= n;
+            if (left == 0) {
+                if (y == h) {
+                    if (count > 0) {
+                        std::cerr << "Too many pixels read\n";
+                        return false;
+                    }
+                    return true;
                 }
+                next_row();
             }
         }
-    } while (currentpixel < pixelcount);
-    return true;
+        if (run)
+            in += bpp;
+    }
 }
 
-bool TGAImage::write_tga_file(const std::string filename, const bool vflip, const bool rle) const {
+bool replace_file(const std::string from, const std::string to) {
+#ifdef _WIN32
+    // std::rename refuses to overwrite on windows
+    bool ok = MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    // rename() swaps the directory entry atomically
+    bool ok = std::rename(from.c_str(), to.c_str()) == 0;
+#endif
+    if (!ok)
+        std::cerr << "can't rename " << from << " to " << to << "\n";
+    return ok;
+}
+
+namespace {
     constexpr std::uint8_t developer_area_ref[4] = { 0, 0, 0, 0 };
     constexpr std::uint8_t extension_area_ref[4] = { 0, 0, 0, 0 };
     constexpr std::uint8_t footer[18] = { 'T','R','U','E','V','I','S','I','O','N','-','X','F','I','L','E','.','\0' };
+    // flush the stream buffer to disk once it grows past this size
+    constexpr size_t stream_buffer_size = 1 << 20;
+
+    TGAHeader make_header(const int w, const int h, const int bpp, const int descriptor, const bool rle) {
+        TGAHeader header;
+        header.bitsperpixel = bpp << 3;
+        header.width = w;
+        header.height = h;
+        header.datatypecode = (bpp == TGAImage::GRAYSCALE ? (rle ? 11 : 3) : (rle ? 10 : 2));
+        header.imagedescriptor = descriptor & 0x30; // 0x20 top-left origin, 0x10 right-to-left rows
+        return header;
+    }
+
+    void append(std::vector<std::uint8_t>& buffer, const void* bytes, const size_t n) {
+        const std::uint8_t* p = reinterpret_cast<const std::uint8_t*>(bytes);
+        buffer.insert(buffer.end(), p, p + n);
+    }
+
+    void append_footer(std::vector<std::uint8_t>& buffer) {
+        append(buffer, developer_area_ref, sizeof(developer_area_ref));
+        append(buffer, extension_area_ref, sizeof(extension_area_ref));
+        append(buffer, footer, sizeof(footer));
+    }
+}
+
+// packets never cross a scanline, so rows can be encoded independently (and in any order)
+void TGAImage::encode_rle_row(const std::uint8_t* row, const int width, const int bpp, std::vector<std::uint8_t>& out) {
+    const int max_chunk_length = 128;
+    int curpix = 0;
+    while (curpix < width) {
+        const std::uint8_t* chunk = row + curpix * bpp;
+        int run_length = 1;
+        bool raw = true;
+        while (curpix + run_length < width && run_length < max_chunk_length) {
+            const std::uint8_t* pixel = row + (curpix + run_length) * bpp;
+            bool succ_eq = !memcmp(pixel - bpp, pixel, bpp);
+            if (1 == run_length)
+                raw = !succ_eq;
+            if (raw && succ_eq) {
+                run_length--;
+                break;
+            }
+            if (!raw && !succ_eq)
+                break;
+            run_length++;
+        }
+        curpix += run_length;
+        out.push_back(static_cast<std::uint8_t>(raw ? run_length - 1 : run_length + 127));
+        out.insert(out.end(), chunk, chunk + (raw ? run_length * bpp : bpp));
+    }
+}
+
+bool TGAImage::write_tga_file(const std::string filename, const bool vflip, const bool rle) const {
     std::ofstream out;
     out.open(filename, std::ios::binary);
     if (!out.is_open()) {
@@ -119,44 +286,36 @@ bool TGAImage::write_tga_file(const std::string filename, const bool vflip, cons
         out.close();
         return false;
     }
-    TGAHeader header;
-    header.bitsperpixel = bpp << 3;
-    header.width = w;
-    header.height = h;
-    header.datatypecode = (bpp == GRAYSCALE ? (rle ? 11 : 3) : (rle ? 10 : 2));
-    header.imagedescriptor = vflip ? 0x00 : 0x20; // top-left or bottom-left origin
-    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
-    if (!out.good()) {
-        out.close();
-        std::cerr << "can't dump the tga file\n";
-        return false;
-    }
+    // the whole file is assembled in memory and dumped with a single write
+    std::vector<std::uint8_t> buffer;
+    // pixels kept in file order are written back exactly as they were read
+    const int descriptor = file_order ? origin_bits : (vflip ? 0x00 : 0x20);
+    TGAHeader header = make_header(w, h, bpp, descriptor, rle);
+    append(buffer, &header, sizeof(header));
     if (!rle) {
-        out.write(reinterpret_cast<const char*>(data.data()), w * h * bpp);
-        if (!out.good()) {
-            std::cerr << "can't unload raw data\n";
-            out.close();
-            return false;
-        }
-    }
-    else if (!unload_rle_data(out)) {
-        out.close();
-        std::cerr << "can't unload rle data\n";
-        return false;
-    }
-    out.write(reinterpret_cast<const char*>(developer_area_ref), sizeof(developer_area_ref));
-    if (!out.good()) {
-        std::cerr << "can't dump the tga file\n";
-        out.close();
-        return false;
+        append(buffer, data.data(), data.size());
     }
-    out.write(reinterpret_cast<const char*>(extension_area_ref), sizeof(extension_area_ref));
-    if (!out.good()) {
-        std::cerr << "can't dump the tga file\n";
-        out.close();
-        return false;
+    else {
+        // rows are split into contiguous bands and every band is encoded by its own thread
+        int nthreads = std::max(1, std::min<int>(std::thread::hardware_concurrency(), h));
+        std::vector<std::vector<std::uint8_t>> bands(nthreads);
+        std::vector<std::thread> workers;
+        for (int t = 0; t < nthreads; t++) {
+            workers.emplace_back([&, t]() {
+                int y0 = h * t / nthreads;
+                int y1 = h * (t + 1) / nthreads;
+                bands[t].reserve(size_t(y1 - y0) * w * bpp / 2);
+                for (int y = y0; y < y1; y++)
+                    encode_rle_row(data.data() + size_t(y) * w * bpp, w, bpp, bands[t]);
+            });
+        }
+        for (auto& worker : workers)
+            worker.join();
+        for (const auto& band : bands)
+            append(buffer, band.data(), band.size());
     }
-    out.write(reinterpret_cast<const char*>(footer), sizeof(footer));
+    append_footer(buffer);
+    out.write(reinterpret_cast<const char*>(buffer.data()), buffer.size());
     if (!out.good()) {
         std::cerr << "can't dump the tga file\n";
         out.close();
@@ -166,46 +325,77 @@ bool TGAImage::write_tga_file(const std::string filename, const bool vflip, cons
     return true;
 }
 
-// TODO: it is not necessary to break a raw chunk for two equal pixels (for the matter of the resulting size)
-bool TGAImage::unload_rle_data(std::ofstream& out) const {
-    const std::uint8_t max_chunk_length = 128;
-    size_t npixels = w * h;
-    size_t curpix = 0;
-    while (curpix < npixels) {
-        size_t chunkstart = curpix * bpp;
-        size_t curbyte = curpix * bpp;
-        std::uint8_t run_length = 1;
-        bool raw = true;
-        while (curpix + run_length < npixels && run_length < max_chunk_length) {
-            bool succ_eq = true;
-            for (int t = 0; succ_eq && t < bpp; t++)
-                succ_eq = (data[curbyte + t] == data[curbyte + t + bpp]);
-            curbyte += bpp;
-            if (1 == run_length)
-                raw = !succ_eq;
-            if (raw && succ_eq) {
-                run_length--;
-                break;
-            }
-            if (!raw && !succ_eq)
-                break;
-            run_length++;
-        }
-        curpix += run_length;
-        out.put(raw ? run_length - 1 : run_length + 127);
-        if (!out.good()) {
-            std::cerr << "can't dump the tga file\n";
-            return false;
-        }
-        out.write(reinterpret_cast<const char*>(data.data() + chunkstart), (raw ? run_length * bpp : bpp));
-        if (!out.good()) {
-            std::cerr << "can't dump the tga file\n";
-            return false;
-        }
+bool TGAStreamWriter::open(const std::string filename, const int width, const int height, const int bytespp, const bool vflip, const bool rle_) {
+    // the previous image stays intact until the new one is complete
+    target = filename;
+    temp = filename + ".tmp";
+    out.open(temp, std::ios::binary);
+    if (!out.is_open()) {
+        std::cerr << "can't open file " << temp << "\n";
+        return false;
     }
+    w = width;
+    h = height;
+    bpp = bytespp;
+    rle = rle_;
+    next_row = 0;
+    failed = false;
+    rows.assign(h, {});
+    ready.assign(h, false);
+    buffer.clear();
+    TGAHeader header = make_header(w, h, bpp, vflip ? 0x00 : 0x20, rle);
+    append(buffer, &header, sizeof(header));
     return true;
 }
 
+void TGAStreamWriter::write_row(const int y, const std::uint8_t* row) {
+    if (y < 0 || y >= h)
+        return;
+    // encoding happens in the calling thread, outside of the lock
+    std::vector<std::uint8_t> encoded;
+    if (rle)
+        TGAImage::encode_rle_row(row, w, bpp, encoded);
+    else
+        encoded.assign(row, row + size_t(w) * bpp);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    rows[y].swap(encoded);
+    ready[y] = true;
+    // rows reach the file strictly in order, whoever completes the gap does the flush
+    while (next_row < h && ready[next_row]) {
+        append(buffer, rows[next_row].data(), rows[next_row].size());
+        std::vector<std::uint8_t>().swap(rows[next_row]);
+        next_row++;
+    }
+    if (buffer.size() >= stream_buffer_size)
+        flush();
+}
+
+void TGAStreamWriter::flush() {
+    out.write(reinterpret_cast<const char*>(buffer.data()), buffer.size());
+    failed = failed || !out.good();
+    buffer.clear();
+}
+
+bool TGAStreamWriter::close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!out.is_open())
+        return false;
+    if (next_row < h) {
+        std::cerr << "tga stream closed with " << h - next_row << " missing rows\n";
+        failed = true;
+    }
+    append_footer(buffer);
+    flush();
+    out.close();
+    if (failed) {
+        std::cerr << "can't dump the tga file\n";
+        std::remove(temp.c_str());
+        return false;
+    }
+    return replace_file(temp, target);
+}
+
 TGAColor TGAImage::get(const int x, const int y) const {
     if (!data.size() || x < 0 || y < 0 || x >= w || y >= h)
         return {};
@@ -217,20 +407,96 @@ void TGAImage::set(int x, int y, const TGAColor& c) {
     memcpy(data.data() + (x + y * w) * bpp, c.bgra, bpp);
 }
 
+namespace {
+    // swap the pixels [a, b) end for end, one pixel at a time
+    void reverse_pixels(std::uint8_t* row, int a, int b, const int bpp) {
+        std::uint8_t tmp[4];
+        for (b--; a < b; a++, b--) {
+            memcpy(tmp, row + a * bpp, bpp);
+            memcpy(row + a * bpp, row + b * bpp, bpp);
+            memcpy(row + b * bpp, tmp, bpp);
+        }
+    }
+
+#if TGA_SSE2
+    // reverse the 16 bytes of a register with SSE2 only
+    inline __m128i reverse_bytes(__m128i v) {
+        v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    }
+#endif
+
+    // mirror one row: blocks from both ends are loaded, reversed in registers and stored crosswise
+    void reverse_row(std::uint8_t* row, const int w, const int bpp) {
+        int i = 0;
+        int e = w;
+#if TGA_SSE2
+        if (bpp == 4) {
+            for (; e - i >= 8; i += 4, e -= 4) {
+                __m128i l = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i * 4));
+                __m128i r = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + (e - 4) * 4));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(row + i * 4), _mm_shuffle_epi32(r, _MM_SHUFFLE(0, 1, 2, 3)));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(row + (e - 4) * 4), _mm_shuffle_epi32(l, _MM_SHUFFLE(0, 1, 2, 3)));
+            }
+        }
+        else if (bpp == 1) {
+            for (; e - i >= 32; i += 16, e -= 16) {
+                __m128i l = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+                __m128i r = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + e - 16));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(row + i), reverse_bytes(r));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(row + e - 16), reverse_bytes(l));
+            }
+        }
+#endif
+#if TGA_SSSE3
+        if (bpp == 3) {
+            // 5 pixels (15 bytes) per register; the 16th byte belongs to a neighbour pixel outside
+            // both blocks and is written back unchanged, so the two blocks must stay 1 pixel apart
+            const __m128i from_right = _mm_setr_epi8(13, 14, 15, 10, 11, 12, 7, 8, 9, 4, 5, 6, 1, 2, 3, -128);
+            const __m128i from_left = _mm_setr_epi8(-128, 12, 13, 14, 9, 10, 11, 6, 7, 8, 3, 4, 5, 0, 1, 2);
+            const __m128i keep_last = _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, -1);
+            const __m128i keep_first = _mm_setr_epi8(-1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+            for (; e - i >= 11; i += 5, e -= 5) {
+                std::uint8_t* lp = row + i * 3;
+                std::uint8_t* rp = row + (e - 5) * 3 - 1;
+                __m128i l = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lp));
+                __m128i r = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rp));
+                __m128i new_l = _mm_or_si128(_mm_shuffle_epi8(r, from_right), _mm_and_si128(l, keep_last));
+                __m128i new_r = _mm_or_si128(_mm_shuffle_epi8(l, from_left), _mm_and_si128(r, keep_first));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(lp), new_l);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(rp), new_r);
+            }
+        }
+#endif
+        reverse_pixels(row, i, e, bpp);
+    }
+}
+
 void TGAImage::flip_horizontally() {
-    int half = w >> 1;
-    for (int i = 0; i < half; i++)
-        for (int j = 0; j < h; j++)
-            for (int b = 0; b < bpp; b++)
-                std::swap(data[(i + j * w) * bpp + b], data[(w - 1 - i + j * w) * bpp + b]);
+    const size_t rowbytes = size_t(w) * bpp;
+    for (int j = 0; j < h; j++)
+        reverse_row(data.data() + j * rowbytes, w, bpp);
+    origin_bits ^= 0x10;
 }
 
+// whole rows are exchanged through a scratch row
 void TGAImage::flip_vertically() {
-    int half = h >> 1;
-    for (int i = 0; i < w; i++)
-        for (int j = 0; j < half; j++)
-            for (int b = 0; b < bpp; b++)
-                std::swap(data[(i + j * w) * bpp + b], data[(i + (h - 1 - j) * w) * bpp + b]);
+    const size_t rowbytes = size_t(w) * bpp;
+    std::vector<std::uint8_t> tmp(rowbytes);
+    for (int j = 0; j < h / 2; j++) {
+        std::uint8_t* top = data.data() + j * rowbytes;
+        std::uint8_t* bottom = data.data() + (h - 1 - j) * rowbytes;
+        memcpy(tmp.data(), top, rowbytes);
+        memcpy(top, bottom, rowbytes);
+        memcpy(bottom, tmp.data(), rowbytes);
+    }
+    origin_bits ^= 0x20;
+}
+
+int TGAImage::origin() const {
+    return origin_bits;
 }
 
 int TGAImage::width() const {
@@ -1,6 +1,8 @@
 #pragma once
 #include <cstdint>
 #include <fstream>
+#include <mutex>
+#include <string>
 #include <vector>
 
 #pragma pack(push,1)
@@ -51,22 +53,55 @@ struct TGAImage {
 
     TGAImage() = default;
     TGAImage(const int w, const int h, const int bpp);
-    bool  read_tga_file(const std::string filename);
+    bool  read_tga_file(const std::string filename, const bool reorient = true);
+    // vflip picks the origin of reoriented images; images read without reorienting keep their own origin bits
     bool write_tga_file(const std::string filename, const bool vflip = true, const bool rle = true) const;
     void flip_horizontally();
     void flip_vertically();
+    // tga descriptor bits of the stored pixels: 0x20 first row on top, 0x10 rows run right to left
+    int origin() const;
     TGAColor get(const int x, const int y) const;
     void set(const int x, const int y, const TGAColor& c);
     int width()  const;
     int height() const;
     bool empty() const;
+    static void encode_rle_row(const std::uint8_t* row, const int width, const int bpp, std::vector<std::uint8_t>& out);
 private:
-    bool   load_rle_data(std::ifstream& in);
-    bool unload_rle_data(std::ofstream& out) const;
+    bool   load_rle_data(const std::uint8_t* in, const std::uint8_t* end, const bool vflip, const bool hflip);
 
     int w = 0;
     int h = 0;
     int bpp = 0;
+    int origin_bits = 0;
+    bool file_order = false;
     std::vector<std::uint8_t> data = {};
 };
 
+// move a finished temporary file over the target in one step, replacing the old one;
+// the target is never missing or half written, even if the process dies in between
+bool replace_file(const std::string from, const std::string to);
+
+// writes a tga file row by row while the image is still being produced;
+// write_row may be called from several threads and in any order.
+// rows go to filename.tmp, close() moves it over filename once the file is complete
+struct TGAStreamWriter {
+    bool open(const std::string filename, const int width, const int height, const int bytespp, const bool vflip = true, const bool rle = true);
+    void write_row(const int y, const std::uint8_t* row);
+    bool close();
+private:
+    void flush();
+
+    std::ofstream out;
+    std::mutex mutex;
+    std::string target;
+    std::string temp;
+    int w = 0;
+    int h = 0;
+    int bpp = 0;
+    bool rle = true;
+    bool failed = false;
+    int next_row = 0;
+    std::vector<std::vector<std::uint8_t>> rows;
+    std::vector<bool> ready;
+    std::vector<std::uint8_t> buffer;
+};
@@ -118,11 +118,16 @@ inline vec3 cross(const vec3& u, const vec3& v) {
         u.e[0] * v.e[1] - u.e[1] * v.e[0]);
 }
 
+//按人眼亮度加权的灰度
+inline double luminance(const vec3& c) {
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
 inline vec3 unit_vector(vec3 v) {
     return v / v.length();
 }
 
-//ڵλڵɵĵλ
+//在单位球内的随机点组成的单位方向向量
 inline vec3 random_unit_vector() {
     auto a = random_double(0, 2 * pi);
     auto z = random_double(-1, 1);
@@ -130,31 +135,31 @@ inline vec3 random_unit_vector() {
     return vec3(r * cos(a), r * sin(a), z);
 }
 
-//- 1 + 1ĵλѡȡһ
+//单位球内均匀分布的随机点，半径按体积取立方根，不用拒绝采样
 inline vec3 random_in_unit_sphere() {
-    while (true) {
-        vec3 p = vec3::random(-1, 1);
-        if (p.length_squared() >= 1)
-            continue;
-        return p;
-    }
+    return cbrt(random_double()) * random_unit_vector();
 }
 
-//ڰڵλ
+//在半球内的随机单位方向向量，方向和法线相反时整体翻过来
 inline vec3 random_in_hemisphere(const vec3& normal) {
     vec3 in_unit_sphere = random_unit_vector();
-    //ȫ(0,0,1)(0,1,0)(1,0,0)
-    if (dot(in_unit_sphere, normal) > 0.0) // In the same hemisphere as the normal
-        return in_unit_sphere;
-    else
-        return -in_unit_sphere;
+    return copysign(1.0, dot(in_unit_sphere, normal)) * in_unit_sphere;
+}
+
+//以z轴为法线、按cos(theta)分布的单位方向，pdf = cos(theta) / pi
+inline vec3 random_cosine_direction() {
+    auto r1 = random_double();
+    auto r2 = random_double();
+    auto phi = 2 * pi * r1;
+    auto s = sqrt(r2);
+    return vec3(cos(phi) * s, sin(phi) * s, sqrt(1 - r2));
 }
 
 inline vec3 reflect(const vec3& v, const vec3& n) {
     return v - 2 * dot(v, n) * n;
 }
 
-//乫ʽ
+//根据折射公式计算
 inline vec3 refract(const vec3& incidentLight, const vec3& Normal, double etai_over_etat) {
     auto cos_theta = dot(-incidentLight, Normal);
     vec3 r_out_parallel = etai_over_etat * (incidentLight + cos_theta * Normal);
@@ -162,20 +167,18 @@ inline vec3 refract(const vec3& incidentLight, const vec3& Normal, double etai_o
     return r_out_parallel + r_out_perp;
 }
 
-//ĸʻǶı
+//发生折射的概率会随着入射角而改变
 inline double schlick(double cosine, double ref_idx) {
     auto r0 = (1 - ref_idx) / (1 + ref_idx);
     r0 = r0 * r0;
     return r0 + (1 - r0) * pow((1 - cosine), 5);
 }
 
-//ӵλԲص
+//单位圆内均匀分布的随机点，半径取平方根，不用拒绝采样
 inline vec3 random_in_unit_disk() {
-    while (true) {
-        auto p = vec3(random_double(-1, 1), random_double(-1, 1), 0);
-        if (p.length_squared() >= 1) continue;
-        return p;
-    }
+    auto r = sqrt(random_double());
+    auto phi = 2 * pi * random_double();
+    return vec3(r * cos(phi), r * sin(phi), 0);
 }
 
 inline int random_int(int min,int max)